@@ -3,8 +3,12 @@
 #include "FormulaBaseListener.h"
 #include "FormulaLexer.h"
 #include "FormulaParser.h"
+#include "binary_io.h"
 
+#include <algorithm>
+#include <array>
 #include <cassert>
+#include <charconv>
 #include <cmath>
 #include <memory>
 #include <optional>
@@ -67,17 +71,40 @@ constexpr PrecedenceRule PRECEDENCE_RULES[EP_END][EP_END] = {
     /* EP_ATOM */ {PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
 };
 
+// Node kinds in the binary form of a formula. Each node is written after its
+// operands as its code followed by the node data.
+enum class NodeCode : char {
+    Number = 'n',    // double value
+    Cell = 'c',      // Position
+    Range = 'r',     // CellRange
+    Unary = 'u',     // operator char
+    Binary = 'b',    // operator char
+    Function = 'f',  // Function, std::uint32_t argument count
+};
+
+// Nodes live in the arena of their FormulaAST and are never destroyed
+// individually, so they must be trivially destructible: children are
+// referenced by plain pointers and the destructor is not virtual.
 class Expr {
 public:
-    virtual ~Expr() = default;
     virtual void Print(std::ostream& out) const = 0;
-    virtual void DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const = 0;
-    virtual double Evaluate(EvaluateFunc func) const = 0;
+    // cell references are printed shifted by origin
+    virtual void DoPrintFormula(std::ostream& out, ExprPrecedence precedence,
+                                Position origin) const = 0;
+    // appends the postfix code of the subtree to the program
+    virtual void Compile(std::vector<Instruction>& program) const = 0;
+    // appends the binary postfix code of the subtree, see FormulaAST::Serialize
+    virtual void Serialize(std::string& out) const = 0;
 
     // higher is tighter
     virtual ExprPrecedence GetPrecedence() const = 0;
 
-    void PrintFormula(std::ostream& out, ExprPrecedence parent_precedence,
+    // ranges are only allowed as function arguments and produce no value
+    virtual bool IsRange() const {
+        return false;
+    }
+
+    void PrintFormula(std::ostream& out, ExprPrecedence parent_precedence, Position origin,
                       bool right_child = false) const {
         auto precedence = GetPrecedence();
         auto mask = right_child ? PR_RIGHT : PR_LEFT;
@@ -86,12 +113,15 @@ public:
             out << '(';
         }
 
-        DoPrintFormula(out, precedence);
+        DoPrintFormula(out, precedence, origin);
 
         if (parens_needed) {
             out << ')';
         }
     }
+
+protected:
+    ~Expr() = default;
 };
 
 namespace {
@@ -105,10 +135,10 @@ public:
     };
 
 public:
-    explicit BinaryOpExpr(Type type, std::unique_ptr<Expr> lhs, std::unique_ptr<Expr> rhs)
+    explicit BinaryOpExpr(Type type, const Expr* lhs, const Expr* rhs)
         : type_(type)
-        , lhs_(std::move(lhs))
-        , rhs_(std::move(rhs)) {
+        , lhs_(lhs)
+        , rhs_(rhs) {
     }
 
     void Print(std::ostream& out) const override {
@@ -119,10 +149,18 @@ public:
         out << ')';
     }
 
-    void DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const override {
-        lhs_->PrintFormula(out, precedence);
+    void DoPrintFormula(std::ostream& out, ExprPrecedence precedence,
+                        Position origin) const override {
+        lhs_->PrintFormula(out, precedence, origin);
         out << static_cast<char>(type_);
-        rhs_->PrintFormula(out, precedence, /* right_child = */ true);
+        rhs_->PrintFormula(out, precedence, origin, /* right_child = */ true);
+    }
+
+    void Serialize(std::string& out) const override {
+        lhs_->Serialize(out);
+        rhs_->Serialize(out);
+        WriteBinary(out, NodeCode::Binary);
+        WriteBinary(out, static_cast<char>(type_));
     }
 
     ExprPrecedence GetPrecedence() const override {
@@ -142,41 +180,34 @@ public:
         }
     }
 
-    double Evaluate(EvaluateFunc func) const override {
-        switch(type_) {
-        case Add:
-            if(!std::isfinite(lhs_->Evaluate(func) + rhs_->Evaluate(func))) {
-                throw FormulaError(FormulaError::Category::Arithmetic);
-            } else {
-                return lhs_->Evaluate(func) + rhs_->Evaluate(func);
-            }
-        case Subtract:
-            if(!std::isfinite(lhs_->Evaluate(func) - rhs_->Evaluate(func))) {
-                throw FormulaError(FormulaError::Category::Arithmetic);
-            } else {
-                return lhs_->Evaluate(func) - rhs_->Evaluate(func);
-            }
-        case Multiply:
-            if(!std::isfinite(lhs_->Evaluate(func) * rhs_->Evaluate(func))) {
-                throw FormulaError(FormulaError::Category::Arithmetic);
-            } else {
-                return lhs_->Evaluate(func) * rhs_->Evaluate(func);
-            }
-        case Divide:
-            if(!std::isfinite(lhs_->Evaluate(func) / rhs_->Evaluate(func))) {
-                throw FormulaError(FormulaError::Category::Arithmetic);
-            } else {
-                return lhs_->Evaluate(func) / rhs_->Evaluate(func);
-            }
-        default:
-            assert(false);
+    void Compile(std::vector<Instruction>& program) const override {
+        lhs_->Compile(program);
+        rhs_->Compile(program);
+
+        Instruction instr{};
+        switch (type_) {
+            case Add:
+                instr.op = Instruction::OpCode::Add;
+                break;
+            case Subtract:
+                instr.op = Instruction::OpCode::Subtract;
+                break;
+            case Multiply:
+                instr.op = Instruction::OpCode::Multiply;
+                break;
+            case Divide:
+                instr.op = Instruction::OpCode::Divide;
+                break;
+            default:
+                assert(false);
         }
+        program.push_back(instr);
     }
 
 private:
     Type type_;
-    std::unique_ptr<Expr> lhs_;
-    std::unique_ptr<Expr> rhs_;
+    const Expr* lhs_;
+    const Expr* rhs_;
 };
 
 class UnaryOpExpr final : public Expr {
@@ -187,9 +218,9 @@ public:
     };
 
 public:
-    explicit UnaryOpExpr(Type type, std::unique_ptr<Expr> operand)
+    explicit UnaryOpExpr(Type type, const Expr* operand)
         : type_(type)
-        , operand_(std::move(operand)) {
+        , operand_(operand) {
     }
 
     void Print(std::ostream& out) const override {
@@ -198,59 +229,262 @@ public:
         out << ')';
     }
 
-    void DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const override {
+    void DoPrintFormula(std::ostream& out, ExprPrecedence precedence,
+                        Position origin) const override {
         out << static_cast<char>(type_);
-        operand_->PrintFormula(out, precedence);
+        operand_->PrintFormula(out, precedence, origin);
+    }
+
+    void Serialize(std::string& out) const override {
+        operand_->Serialize(out);
+        WriteBinary(out, NodeCode::Unary);
+        WriteBinary(out, static_cast<char>(type_));
     }
 
     ExprPrecedence GetPrecedence() const override {
         return EP_UNARY;
     }
 
-    double Evaluate(EvaluateFunc func) const override {
-        switch(type_) {
-        case UnaryMinus:
-            return -operand_->Evaluate(func);
-        case UnaryPlus:
-            return operand_->Evaluate(func);
-        default:
-            assert(false);
+    void Compile(std::vector<Instruction>& program) const override {
+        operand_->Compile(program);
+
+        // unary plus is a no-op and produces no code
+        if (type_ == UnaryMinus) {
+            Instruction instr{};
+            instr.op = Instruction::OpCode::Negate;
+            program.push_back(instr);
         }
     }
 
 private:
     Type type_;
-    std::unique_ptr<Expr> operand_;
+    const Expr* operand_;
 };
 
+void PrintCell(std::ostream& out, Position cell) {
+    if (!cell.IsValid()) {
+        out << FormulaError::Category::Ref;
+    } else {
+        out << cell.ToString();
+    }
+}
+
+Position Shift(Position cell, Position origin) {
+    return {origin.row + cell.row, origin.col + cell.col};
+}
+
 class CellExpr final : public Expr {
 public:
-    explicit CellExpr(const Position* cell)
+    explicit CellExpr(Position cell)
         : cell_(cell) {
     }
 
+    Position* GetCell() {
+        return &cell_;
+    }
+
     void Print(std::ostream& out) const override {
-        if (!cell_->IsValid()) {
-            out << FormulaError::Category::Ref;
-        } else {
-            out << cell_->ToString();
+        PrintCell(out, cell_);
+    }
+
+    void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */,
+                        Position origin) const override {
+        PrintCell(out, Shift(cell_, origin));
+    }
+
+    void Serialize(std::string& out) const override {
+        WriteBinary(out, NodeCode::Cell);
+        WriteBinary(out, cell_);
+    }
+
+    ExprPrecedence GetPrecedence() const override {
+        return EP_ATOM;
+    }
+
+    void Compile(std::vector<Instruction>& program) const override {
+        Instruction instr{};
+        instr.op = Instruction::OpCode::LoadCell;
+        instr.cell = &cell_;
+        program.push_back(instr);
+    }
+
+private:
+    Position cell_;
+};
+
+class RangeExpr final : public Expr {
+public:
+    explicit RangeExpr(CellRange range)
+        : range_(range) {
+    }
+
+    CellRange* GetRange() {
+        return &range_;
+    }
+
+    void Print(std::ostream& out) const override {
+        DoPrintFormula(out, EP_ATOM, {0, 0});
+    }
+
+    void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */,
+                        Position origin) const override {
+        PrintCell(out, Shift(range_.first, origin));
+        out << ':';
+        PrintCell(out, Shift(range_.last, origin));
+    }
+
+    void Serialize(std::string& out) const override {
+        WriteBinary(out, NodeCode::Range);
+        WriteBinary(out, range_);
+    }
+
+    ExprPrecedence GetPrecedence() const override {
+        return EP_ATOM;
+    }
+
+    bool IsRange() const override {
+        return true;
+    }
+
+    void Compile(std::vector<Instruction>& program) const override {
+        Instruction instr{};
+        instr.op = Instruction::OpCode::AggregateRange;
+        instr.range = &range_;
+        program.push_back(instr);
+    }
+
+private:
+    CellRange range_;
+};
+
+class FunctionExpr final : public Expr {
+public:
+    // args is an array of arg_count nodes
+    explicit FunctionExpr(Function function, const Expr* const* args, size_t arg_count)
+        : function_(function)
+        , args_(args)
+        , arg_count_(arg_count) {
+    }
+
+    // throws ParsingError for an unknown name
+    static Function GetFunction(std::string_view name) {
+        for (size_t i = 0; i < NAMES.size(); ++i) {
+            if (NAMES[i] == name) {
+                return static_cast<Function>(i);
+            }
+        }
+        throw ParsingError("Unknown function: " + std::string(name));
+    }
+
+    void Print(std::ostream& out) const override {
+        out << '(' << GetName();
+        for (size_t i = 0; i < arg_count_; ++i) {
+            out << ' ';
+            args_[i]->Print(out);
         }
+        out << ')';
     }
 
-    void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */) const override {
-        Print(out);
+    void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */,
+                        Position origin) const override {
+        out << GetName() << '(';
+        for (size_t i = 0; i < arg_count_; ++i) {
+            if (i > 0) {
+                out << ',';
+            }
+            // arguments are delimited by commas, so they never need parentheses
+            args_[i]->PrintFormula(out, EP_ADD, origin);
+        }
+        out << ')';
+    }
+
+    void Serialize(std::string& out) const override {
+        for (size_t i = 0; i < arg_count_; ++i) {
+            args_[i]->Serialize(out);
+        }
+        WriteBinary(out, NodeCode::Function);
+        WriteBinary(out, function_);
+        WriteBinary(out, static_cast<std::uint32_t>(arg_count_));
     }
 
     ExprPrecedence GetPrecedence() const override {
         return EP_ATOM;
     }
 
-    double Evaluate(EvaluateFunc func) const override {
-        return func(*cell_);
+    void Compile(std::vector<Instruction>& program) const override {
+        Instruction begin{};
+        begin.op = Instruction::OpCode::BeginAggregate;
+        begin.function = function_;
+        program.push_back(begin);
+
+        for (size_t i = 0; i < arg_count_; ++i) {
+            const Expr* arg = args_[i];
+            arg->Compile(program);
+            if (!arg->IsRange()) {
+                Instruction instr{};
+                instr.op = Instruction::OpCode::AggregateValue;
+                program.push_back(instr);
+            }
+        }
+
+        Instruction end{};
+        end.op = Instruction::OpCode::EndAggregate;
+        program.push_back(end);
     }
 
 private:
-    const Position* cell_;
+    // indexed by Function
+    static constexpr std::array<std::string_view, 5> NAMES = {"SUM", "AVERAGE", "MIN", "MAX", "COUNT"};
+
+    std::string_view GetName() const {
+        return NAMES[static_cast<size_t>(function_)];
+    }
+
+    Function function_;
+    const Expr* const* args_;
+    size_t arg_count_;
+};
+
+// corners of the rectangle spanned by two cells, in any order
+CellRange MakeRange(Position a, Position b) {
+    return {{std::min(a.row, b.row), std::min(a.col, b.col)},
+            {std::max(a.row, b.row), std::max(a.col, b.col)}};
+}
+
+// Allocates the nodes of the tree being parsed in one arena and collects
+// the references; shared by both parsers
+class ASTBuilder {
+public:
+    template <typename T, typename... Args>
+    const Expr* Make(Args&&... args) {
+        return arena_.Create<T>(std::forward<Args>(args)...);
+    }
+
+    const Expr* MakeCell(Position cell) {
+        auto* node = arena_.Create<CellExpr>(cell);
+        cells_.push_back(node->GetCell());
+        return node;
+    }
+
+    const Expr* MakeRangeRef(CellRange range) {
+        auto* node = arena_.Create<RangeExpr>(range);
+        ranges_.push_back(node->GetRange());
+        return node;
+    }
+
+    const Expr* MakeFunction(Function function, const std::vector<const Expr*>& args) {
+        return arena_.Create<FunctionExpr>(function, arena_.CopyArray(args.data(), args.size()),
+                                           args.size());
+    }
+
+    FormulaAST Build(const Expr* root) {
+        return FormulaAST(std::move(arena_), root, std::move(cells_), std::move(ranges_));
+    }
+
+private:
+    Arena arena_;
+    std::vector<Position*> cells_;
+    std::vector<CellRange*> ranges_;
 };
 
 class NumberExpr final : public Expr {
@@ -263,16 +497,25 @@ public:
         out << value_;
     }
 
-    void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */) const override {
+    void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */,
+                        Position /* origin */) const override {
         out << value_;
     }
 
+    void Serialize(std::string& out) const override {
+        WriteBinary(out, NodeCode::Number);
+        WriteBinary(out, value_);
+    }
+
     ExprPrecedence GetPrecedence() const override {
         return EP_ATOM;
     }
 
-    double Evaluate(EvaluateFunc func) const override {
-        return value_;
+    void Compile(std::vector<Instruction>& program) const override {
+        Instruction instr{};
+        instr.op = Instruction::OpCode::PushNumber;
+        instr.number = value_;
+        program.push_back(instr);
     }
 
 private:
@@ -281,23 +524,19 @@ private:
 
 class ParseASTListener final : public FormulaBaseListener {
 public:
-    std::unique_ptr<Expr> MoveRoot() {
+    FormulaAST Build() {
         assert(args_.size() == 1);
-        auto root = std::move(args_.front());
+        auto root = args_.front();
         args_.clear();
 
-        return root;
-    }
-
-    std::forward_list<Position> MoveCells() {
-        return std::move(cells_);
+        return builder_.Build(root);
     }
 
 public:
     void exitUnaryOp(FormulaParser::UnaryOpContext* ctx) override {
         assert(args_.size() >= 1);
 
-        auto operand = std::move(args_.back());
+        auto operand = args_.back();
 
         UnaryOpExpr::Type type;
         if (ctx->SUB()) {
@@ -307,8 +546,7 @@ public:
             type = UnaryOpExpr::UnaryPlus;
         }
 
-        auto node = std::make_unique<UnaryOpExpr>(type, std::move(operand));
-        args_.back() = std::move(node);
+        args_.back() = builder_.Make<UnaryOpExpr>(type, operand);
     }
 
     void exitLiteral(FormulaParser::LiteralContext* ctx) override {
@@ -320,8 +558,7 @@ public:
             throw ParsingError("Invalid number: " + valueStr);
         }
 
-        auto node = std::make_unique<NumberExpr>(value);
-        args_.push_back(std::move(node));
+        args_.push_back(builder_.Make<NumberExpr>(value));
     }
 
     void exitCell(FormulaParser::CellContext* ctx) override {
@@ -331,18 +568,41 @@ public:
             throw FormulaException("Invalid position: " + value_str);
         }
 
-        cells_.push_front(value);
-        auto node = std::make_unique<CellExpr>(&cells_.front());
-        args_.push_back(std::move(node));
+        args_.push_back(builder_.MakeCell(value));
+    }
+
+    void exitRange(FormulaParser::RangeContext* ctx) override {
+        std::array<Position, 2> corners;
+        for (size_t i = 0; i < corners.size(); ++i) {
+            auto value_str = ctx->CELL(i)->getSymbol()->getText();
+            corners[i] = Position::FromString(value_str);
+            if (!corners[i].IsValid()) {
+                throw FormulaException("Invalid position: " + value_str);
+            }
+        }
+
+        args_.push_back(builder_.MakeRangeRef(MakeRange(corners[0], corners[1])));
+    }
+
+    void exitFunction(FormulaParser::FunctionContext* ctx) override {
+        const auto function = FunctionExpr::GetFunction(ctx->NAME()->getSymbol()->getText());
+
+        const size_t arg_count = ctx->arg().size();
+        assert(args_.size() >= arg_count);
+
+        std::vector<const Expr*> function_args(args_.end() - arg_count, args_.end());
+        args_.resize(args_.size() - arg_count);
+
+        args_.push_back(builder_.MakeFunction(function, function_args));
     }
 
     void exitBinaryOp(FormulaParser::BinaryOpContext* ctx) override {
         assert(args_.size() >= 2);
 
-        auto rhs = std::move(args_.back());
+        auto rhs = args_.back();
         args_.pop_back();
 
-        auto lhs = std::move(args_.back());
+        auto lhs = args_.back();
 
         BinaryOpExpr::Type type;
         if (ctx->ADD()) {
@@ -356,8 +616,7 @@ public:
             type = BinaryOpExpr::Divide;
         }
 
-        auto node = std::make_unique<BinaryOpExpr>(type, std::move(lhs), std::move(rhs));
-        args_.back() = std::move(node);
+        args_.back() = builder_.Make<BinaryOpExpr>(type, lhs, rhs);
     }
 
     void visitErrorNode(antlr4::tree::ErrorNode* node) override {
@@ -365,8 +624,287 @@ public:
     }
 
 private:
-    std::vector<std::unique_ptr<Expr>> args_;
-    std::forward_list<Position> cells_;
+    std::vector<const Expr*> args_;
+    ASTBuilder builder_;
+};
+
+// Hand-written equivalent of the lexer generated from Formula.g4
+class FastLexer {
+public:
+    struct Token {
+        enum Type { End, Number, Cell, Name, Add, Sub, Mul, Div, LeftParen, RightParen, Colon, Comma };
+
+        Type type = End;
+        std::string_view text;
+    };
+
+    explicit FastLexer(std::string_view text)
+        : text_(text) {
+    }
+
+    Token Next() {
+        while (pos_ < text_.size() &&
+               (text_[pos_] == ' ' || text_[pos_] == '\t' || text_[pos_] == '\n' || text_[pos_] == '\r')) {
+            ++pos_;
+        }
+        if (pos_ == text_.size()) {
+            return {Token::End, {}};
+        }
+
+        const size_t start = pos_;
+        const char c = text_[pos_];
+        Token::Type type;
+        if (IsDigit(c) || (c == '.' && IsDigitAt(pos_ + 1))) {
+            type = Token::Number;
+            pos_ = ScanNumber(pos_);
+        } else if (IsUpper(c)) {
+            // CELL: [A-Z]+[0-9]+ or NAME: [A-Z]+
+            while (pos_ < text_.size() && IsUpper(text_[pos_])) {
+                ++pos_;
+            }
+            if (IsDigitAt(pos_)) {
+                pos_ = SkipDigits(pos_);
+                type = Token::Cell;
+            } else {
+                type = Token::Name;
+            }
+        } else {
+            switch (c) {
+                case '+':
+                    type = Token::Add;
+                    break;
+                case '-':
+                    type = Token::Sub;
+                    break;
+                case '*':
+                    type = Token::Mul;
+                    break;
+                case '/':
+                    type = Token::Div;
+                    break;
+                case '(':
+                    type = Token::LeftParen;
+                    break;
+                case ')':
+                    type = Token::RightParen;
+                    break;
+                case ':':
+                    type = Token::Colon;
+                    break;
+                case ',':
+                    type = Token::Comma;
+                    break;
+                default:
+                    throw ParsingError("Error when lexing: " + std::string(text_.substr(start)));
+            }
+            ++pos_;
+        }
+        return {type, text_.substr(start, pos_ - start)};
+    }
+
+    static Position ParseCell(std::string_view text) {
+        auto value = Position::FromString(text);
+        if (!value.IsValid()) {
+            throw FormulaException("Invalid position: " + std::string(text));
+        }
+        return value;
+    }
+
+private:
+    static bool IsDigit(char c) {
+        return c >= '0' && c <= '9';
+    }
+
+    static bool IsUpper(char c) {
+        return c >= 'A' && c <= 'Z';
+    }
+
+    bool IsDigitAt(size_t pos) const {
+        return pos < text_.size() && IsDigit(text_[pos]);
+    }
+
+    size_t SkipDigits(size_t pos) const {
+        while (IsDigitAt(pos)) {
+            ++pos;
+        }
+        return pos;
+    }
+
+    // NUMBER: UINT EXPONENT? | UINT? '.' UINT EXPONENT?
+    size_t ScanNumber(size_t pos) const {
+        pos = SkipDigits(pos);
+        if (pos < text_.size() && text_[pos] == '.' && IsDigitAt(pos + 1)) {
+            pos = SkipDigits(pos + 1);
+        }
+        if (pos < text_.size() && (text_[pos] == 'e' || text_[pos] == 'E')) {
+            size_t exponent = pos + 1;
+            if (exponent < text_.size() && (text_[exponent] == '+' || text_[exponent] == '-')) {
+                ++exponent;
+            }
+            if (IsDigitAt(exponent)) {
+                pos = SkipDigits(exponent);
+            }
+        }
+        return pos;
+    }
+
+    std::string_view text_;
+    size_t pos_ = 0;
+};
+
+// Hand-written equivalent of the parser generated from Formula.g4.
+// Precedence (tightest first): parentheses and function calls, unary +/-, binary * and /,
+// binary + and -. Binary operators are left-associative.
+class FastParser {
+public:
+    using Token = FastLexer::Token;
+
+    explicit FastParser(std::string_view text)
+        : lexer_(text) {
+        Advance();
+    }
+
+    FormulaAST ParseMain() {
+        auto root = ParseExpr(EP_ADD);
+        if (token_.type != Token::End) {
+            throw ParsingError("Unexpected token: " + std::string(token_.text));
+        }
+        return builder_.Build(root);
+    }
+
+private:
+    void Advance() {
+        token_ = lexer_.Next();
+    }
+
+    // min_precedence is EP_ADD for any binary operator or EP_MUL for * and / only
+    const Expr* ParseExpr(ExprPrecedence min_precedence) {
+        auto lhs = ParseUnary();
+        while (true) {
+            BinaryOpExpr::Type type;
+            ExprPrecedence precedence;
+            switch (token_.type) {
+                case Token::Add:
+                    type = BinaryOpExpr::Add;
+                    precedence = EP_ADD;
+                    break;
+                case Token::Sub:
+                    type = BinaryOpExpr::Subtract;
+                    precedence = EP_ADD;
+                    break;
+                case Token::Mul:
+                    type = BinaryOpExpr::Multiply;
+                    precedence = EP_MUL;
+                    break;
+                case Token::Div:
+                    type = BinaryOpExpr::Divide;
+                    precedence = EP_MUL;
+                    break;
+                default:
+                    return lhs;
+            }
+            if (precedence < min_precedence) {
+                return lhs;
+            }
+            Advance();
+
+            auto rhs = ParseExpr(precedence == EP_ADD ? EP_MUL : EP_UNARY);
+            lhs = builder_.Make<BinaryOpExpr>(type, lhs, rhs);
+        }
+    }
+
+    const Expr* ParseUnary() {
+        if (token_.type == Token::Add || token_.type == Token::Sub) {
+            const auto type = token_.type == Token::Sub ? UnaryOpExpr::UnaryMinus : UnaryOpExpr::UnaryPlus;
+            Advance();
+            return builder_.Make<UnaryOpExpr>(type, ParseUnary());
+        }
+        return ParsePrimary();
+    }
+
+    const Expr* ParsePrimary() {
+        const Token token = token_;
+        switch (token.type) {
+            case Token::Number: {
+                double value = 0;
+                auto [end, ec] = std::from_chars(token.text.data(), token.text.data() + token.text.size(), value);
+                if (ec != std::errc() || end != token.text.data() + token.text.size()) {
+                    throw ParsingError("Invalid number: " + std::string(token.text));
+                }
+                Advance();
+                return builder_.Make<NumberExpr>(value);
+            }
+            case Token::Cell: {
+                const Position cell = FastLexer::ParseCell(token.text);
+                Advance();
+                return builder_.MakeCell(cell);
+            }
+            case Token::LeftParen: {
+                Advance();
+                auto expr = ParseExpr(EP_ADD);
+                Expect(Token::RightParen);
+                return expr;
+            }
+            case Token::Name:
+                return ParseFunction();
+            default:
+                throw UnexpectedToken();
+        }
+    }
+
+    // NAME '(' (arg (',' arg)*)? ')'
+    const Expr* ParseFunction() {
+        const auto function = FunctionExpr::GetFunction(token_.text);
+        Advance();
+        Expect(Token::LeftParen);
+
+        std::vector<const Expr*> args;
+        if (token_.type != Token::RightParen) {
+            args.push_back(ParseArgument());
+            while (token_.type == Token::Comma) {
+                Advance();
+                args.push_back(ParseArgument());
+            }
+        }
+        Expect(Token::RightParen);
+        return builder_.MakeFunction(function, args);
+    }
+
+    // CELL ':' CELL | expr
+    const Expr* ParseArgument() {
+        if (token_.type == Token::Cell) {
+            FastLexer lookahead = lexer_;
+            if (lookahead.Next().type == Token::Colon) {
+                const Position first = FastLexer::ParseCell(token_.text);
+                Advance();
+                Advance();
+                if (token_.type != Token::Cell) {
+                    throw UnexpectedToken();
+                }
+                const Position last = FastLexer::ParseCell(token_.text);
+                Advance();
+
+                return builder_.MakeRangeRef(MakeRange(first, last));
+            }
+        }
+        return ParseExpr(EP_ADD);
+    }
+
+    void Expect(Token::Type type) {
+        if (token_.type != type) {
+            throw UnexpectedToken();
+        }
+        Advance();
+    }
+
+    ParsingError UnexpectedToken() const {
+        return ParsingError(token_.type == Token::End ? "Unexpected end of formula"
+                                                      : "Unexpected token: " + std::string(token_.text));
+    }
+
+    FastLexer lexer_;
+    Token token_;
+    ASTBuilder builder_;
 };
 
 class BailErrorListener : public antlr4::BaseErrorListener {
@@ -403,17 +941,122 @@ FormulaAST ParseFormulaAST(std::istream& in) {
     ASTImpl::ParseASTListener listener;
     tree::ParseTreeWalker::DEFAULT.walk(&listener, tree);
 
-    return FormulaAST(listener.MoveRoot(), listener.MoveCells());
+    return listener.Build();
+}
+
+std::string GetRelativeFormulaKey(std::string_view in, Position origin) {
+    using Token = ASTImpl::FastLexer::Token;
+
+    ASTImpl::FastLexer lexer(in);
+    std::string key;
+    key.reserve(in.size());
+    for (Token token = lexer.Next(); token.type != Token::End; token = lexer.Next()) {
+        if (token.type == Token::Cell) {
+            const Position cell = ASTImpl::FastLexer::ParseCell(token.text);
+            key += '@';
+            key += std::to_string(cell.row - origin.row);
+            key += ',';
+            key += std::to_string(cell.col - origin.col);
+        } else {
+            key += token.text;
+        }
+        // tokens are separated so that e.g. "1 2" and "12" get different keys
+        key += ' ';
+    }
+    return key;
+}
+
+FormulaAST ParseFormulaASTFast(std::string_view in) {
+    ASTImpl::FastParser parser(in);
+    return parser.ParseMain();
+}
+
+FormulaAST DeserializeFormulaAST(std::string_view data) {
+    using namespace ASTImpl;
+
+    ASTBuilder builder;
+    std::vector<const Expr*> operands;
+    auto pop_operand = [&operands]() {
+        if (operands.empty() || operands.back()->IsRange()) {
+            throw ParsingError("Invalid formula code: missing operand");
+        }
+        const Expr* operand = operands.back();
+        operands.pop_back();
+        return operand;
+    };
+
+    BinaryReader reader(data);
+    while (!reader.AtEnd()) {
+        switch (reader.Read<NodeCode>()) {
+            case NodeCode::Number:
+                operands.push_back(builder.Make<NumberExpr>(reader.Read<double>()));
+                break;
+            case NodeCode::Cell:
+                operands.push_back(builder.MakeCell(reader.Read<Position>()));
+                break;
+            case NodeCode::Range: {
+                const auto range = reader.Read<CellRange>();
+                operands.push_back(builder.MakeRangeRef(MakeRange(range.first, range.last)));
+                break;
+            }
+            case NodeCode::Unary: {
+                const auto type = static_cast<UnaryOpExpr::Type>(reader.Read<char>());
+                if (type != UnaryOpExpr::UnaryPlus && type != UnaryOpExpr::UnaryMinus) {
+                    throw ParsingError("Invalid formula code: unknown unary operator");
+                }
+                operands.push_back(builder.Make<UnaryOpExpr>(type, pop_operand()));
+                break;
+            }
+            case NodeCode::Binary: {
+                const auto type = static_cast<BinaryOpExpr::Type>(reader.Read<char>());
+                if (type != BinaryOpExpr::Add && type != BinaryOpExpr::Subtract &&
+                    type != BinaryOpExpr::Multiply && type != BinaryOpExpr::Divide) {
+                    throw ParsingError("Invalid formula code: unknown binary operator");
+                }
+                const Expr* rhs = pop_operand();
+                const Expr* lhs = pop_operand();
+                operands.push_back(builder.Make<BinaryOpExpr>(type, lhs, rhs));
+                break;
+            }
+            case NodeCode::Function: {
+                const auto function = reader.Read<Function>();
+                const auto arg_count = reader.Read<std::uint32_t>();
+                if (function > Function::Count) {
+                    throw ParsingError("Invalid formula code: unknown function");
+                }
+                if (arg_count > operands.size()) {
+                    throw ParsingError("Invalid formula code: missing operand");
+                }
+                // ranges are allowed here
+                std::vector<const Expr*> args(operands.end() - arg_count, operands.end());
+                operands.resize(operands.size() - arg_count);
+                operands.push_back(builder.MakeFunction(function, args));
+                break;
+            }
+            default:
+                throw ParsingError("Invalid formula code: unknown node");
+        }
+    }
+
+    const Expr* root = pop_operand();
+    if (!operands.empty()) {
+        throw ParsingError("Invalid formula code: extra operands");
+    }
+    return builder.Build(root);
 }
 
 FormulaAST ParseFormulaAST(const std::string& in_str) {
-    std::istringstream in(in_str);
-    return ParseFormulaAST(in);
+    try {
+        return ParseFormulaASTFast(in_str);
+    } catch (const std::exception&) {
+        std::istringstream in(in_str);
+        return ParseFormulaAST(in);
+    }
 }
 
 void FormulaAST::PrintCells(std::ostream& out) const {
-    for (auto cell : cells_) {
-        out << cell.ToString() << ' ';
+    for (const Position* cell : cells_) {
+        out << cell->ToString() << ' ';
     }
 }
 
@@ -421,18 +1064,277 @@ void FormulaAST::Print(std::ostream& out) const {
     root_expr_->Print(out);
 }
 
-void FormulaAST::PrintFormula(std::ostream& out) const {
-    root_expr_->PrintFormula(out, ASTImpl::EP_ATOM);
+void FormulaAST::PrintFormula(std::ostream& out, Position origin) const {
+    root_expr_->PrintFormula(out, ASTImpl::EP_ATOM, origin);
+}
+
+void FormulaAST::Serialize(std::string& out) const {
+    root_expr_->Serialize(out);
+}
+
+namespace {
+double CheckFinite(double value) {
+    if (!std::isfinite(value)) {
+        throw FormulaError(FormulaError::Category::Arithmetic);
+    }
+    return value;
+}
+
+// Kernels process batches of values in independent lanes, so the loops
+// have no dependency chain between iterations and are vectorized by the
+// compiler; the lanes are combined at the end of the batch.
+constexpr size_t KERNEL_LANES = 4;
+
+double SumKernel(const double* values, size_t count) {
+    std::array<double, KERNEL_LANES> lanes{};
+    size_t i = 0;
+    for (; i + KERNEL_LANES <= count; i += KERNEL_LANES) {
+        for (size_t lane = 0; lane < KERNEL_LANES; ++lane) {
+            lanes[lane] += values[i + lane];
+        }
+    }
+    double sum = (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+    for (; i < count; ++i) {
+        sum += values[i];
+    }
+    return sum;
+}
+
+// count must be positive
+template <typename Select>
+double SelectKernel(const double* values, size_t count, Select select) {
+    std::array<double, KERNEL_LANES> lanes;
+    lanes.fill(values[0]);
+    size_t i = 0;
+    for (; i + KERNEL_LANES <= count; i += KERNEL_LANES) {
+        for (size_t lane = 0; lane < KERNEL_LANES; ++lane) {
+            lanes[lane] = select(lanes[lane], values[i + lane]);
+        }
+    }
+    double result = select(select(lanes[0], lanes[1]), select(lanes[2], lanes[3]));
+    for (; i < count; ++i) {
+        result = select(result, values[i]);
+    }
+    return result;
+}
+
+class Accumulator {
+public:
+    using Function = ASTImpl::Function;
+
+    void Reset(Function function) {
+        function_ = function;
+        value_ = 0;
+        count_ = 0;
+    }
+
+    void Add(const double* values, size_t count) {
+        if (count == 0) {
+            return;
+        }
+        switch (function_) {
+            case Function::Sum:
+            case Function::Average:
+                value_ += SumKernel(values, count);
+                break;
+            case Function::Min: {
+                const double min = SelectKernel(values, count, [](double a, double b) {
+                    return b < a ? b : a;
+                });
+                value_ = count_ == 0 ? min : std::min(value_, min);
+                break;
+            }
+            case Function::Max: {
+                const double max = SelectKernel(values, count, [](double a, double b) {
+                    return b > a ? b : a;
+                });
+                value_ = count_ == 0 ? max : std::max(value_, max);
+                break;
+            }
+            case Function::Count:
+                break;
+        }
+        count_ += count;
+    }
+
+    // MIN and MAX of no values are 0, AVERAGE of no values is an arithmetic error
+    double GetResult() const {
+        switch (function_) {
+            case Function::Average:
+                return CheckFinite(value_ / static_cast<double>(count_));
+            case Function::Count:
+                return static_cast<double>(count_);
+            default:
+                return CheckFinite(value_);
+        }
+    }
+
+private:
+    Function function_ = Function::Sum;
+    double value_ = 0;
+    size_t count_ = 0;
+};
+}  // namespace
+
+double FormulaAST::Execute(const EvaluateFunc& func, const GatherRangeFunc& gather) const {
+    using OpCode = ASTImpl::Instruction::OpCode;
+
+    // typical formulas fit into the inline stack, so no allocation happens
+    constexpr size_t INLINE_STACK_SIZE = 64;
+    std::array<double, INLINE_STACK_SIZE> inline_stack;
+    std::vector<double> heap_stack;
+    double* stack = inline_stack.data();
+    if (max_stack_depth_ > INLINE_STACK_SIZE) {
+        heap_stack.resize(max_stack_depth_);
+        stack = heap_stack.data();
+    }
+
+    // accumulators of the nested function calls being evaluated
+    constexpr size_t INLINE_AGGREGATES_SIZE = 8;
+    std::array<Accumulator, INLINE_AGGREGATES_SIZE> inline_aggregates;
+    std::vector<Accumulator> heap_aggregates;
+    Accumulator* aggregates = inline_aggregates.data();
+    if (max_aggregate_depth_ > INLINE_AGGREGATES_SIZE) {
+        heap_aggregates.resize(max_aggregate_depth_);
+        aggregates = heap_aggregates.data();
+    }
+    // aggregates[aggregate_depth - 1] is the innermost call
+    size_t aggregate_depth = 0;
+    const RangeValuesConsumer consume = [aggregates, &aggregate_depth](const double* values, size_t count) {
+        aggregates[aggregate_depth - 1].Add(values, count);
+    };
+
+    // top points to the first free slot
+    double* top = stack;
+    for (const ASTImpl::Instruction& instr : program_) {
+        switch (instr.op) {
+            case OpCode::PushNumber:
+                *top++ = instr.number;
+                break;
+            case OpCode::LoadCell:
+                *top++ = func(*instr.cell);
+                break;
+            case OpCode::Add:
+                --top;
+                top[-1] = CheckFinite(top[-1] + top[0]);
+                break;
+            case OpCode::Subtract:
+                --top;
+                top[-1] = CheckFinite(top[-1] - top[0]);
+                break;
+            case OpCode::Multiply:
+                --top;
+                top[-1] = CheckFinite(top[-1] * top[0]);
+                break;
+            case OpCode::Divide:
+                --top;
+                top[-1] = CheckFinite(top[-1] / top[0]);
+                break;
+            case OpCode::Negate:
+                top[-1] = -top[-1];
+                break;
+            case OpCode::BeginAggregate:
+                aggregates[aggregate_depth++].Reset(instr.function);
+                break;
+            case OpCode::AggregateValue:
+                --top;
+                aggregates[aggregate_depth - 1].Add(top, 1);
+                break;
+            case OpCode::AggregateRange:
+                gather(*instr.range, consume);
+                break;
+            case OpCode::EndAggregate:
+                *top++ = aggregates[--aggregate_depth].GetResult();
+                break;
+        }
+    }
+
+    assert(top == stack + 1 && aggregate_depth == 0);
+    return stack[0];
+}
+
+void FormulaAST::Compile() {
+    using OpCode = ASTImpl::Instruction::OpCode;
+
+    program_.clear();
+    root_expr_->Compile(program_);
+
+    size_t depth = 0;
+    size_t aggregate_depth = 0;
+    max_stack_depth_ = 0;
+    max_aggregate_depth_ = 0;
+    for (const ASTImpl::Instruction& instr : program_) {
+        switch (instr.op) {
+            case OpCode::PushNumber:
+            case OpCode::LoadCell:
+                max_stack_depth_ = std::max(max_stack_depth_, ++depth);
+                break;
+            case OpCode::Add:
+            case OpCode::Subtract:
+            case OpCode::Multiply:
+            case OpCode::Divide:
+            case OpCode::AggregateValue:
+                --depth;
+                break;
+            case OpCode::Negate:
+            case OpCode::AggregateRange:
+                break;
+            case OpCode::BeginAggregate:
+                max_aggregate_depth_ = std::max(max_aggregate_depth_, ++aggregate_depth);
+                break;
+            case OpCode::EndAggregate:
+                --aggregate_depth;
+                max_stack_depth_ = std::max(max_stack_depth_, ++depth);
+                break;
+        }
+    }
 }
 
-double FormulaAST::Execute(EvaluateFunc func) const {
-    return root_expr_->Evaluate(func);
+FormulaAST::FormulaAST(Arena arena, const ASTImpl::Expr* root_expr, std::vector<Position*> cells,
+                       std::vector<CellRange*> ranges)
+    : arena_(std::move(arena))
+    , root_expr_(root_expr)
+    , cells_(std::move(cells))
+    , ranges_(std::move(ranges)) {
+    // to avoid sorting in GetReferencedCells
+    std::sort(cells_.begin(), cells_.end(), [](const Position* lhs, const Position* rhs) {
+        return *lhs < *rhs;
+    });
+    Compile();
 }
 
-FormulaAST::FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr, std::forward_list<Position> cells)
-    : root_expr_(std::move(root_expr))
-    , cells_(std::move(cells)) {
-    cells_.sort();  // to avoid sorting in GetReferencedCells
+std::vector<Position> FormulaAST::GetCells() const {
+    std::vector<Position> cells;
+    cells.reserve(cells_.size());
+    for (const Position* cell : cells_) {
+        cells.push_back(*cell);
+    }
+    return cells;
+}
+
+std::vector<CellRange> FormulaAST::GetRanges() const {
+    std::vector<CellRange> ranges;
+    ranges.reserve(ranges_.size());
+    for (const CellRange* range : ranges_) {
+        ranges.push_back(*range);
+    }
+    return ranges;
+}
+
+void FormulaAST::ShiftReferences(Position offset) {
+    auto shift = [offset](Position& cell) {
+        cell.row += offset.row;
+        cell.col += offset.col;
+    };
+    for (Position* cell : cells_) {
+        shift(*cell);
+    }
+    for (CellRange* range : ranges_) {
+        shift(range->first);
+        shift(range->last);
+    }
 }
 
+FormulaAST::FormulaAST(FormulaAST&&) = default;
+FormulaAST& FormulaAST::operator=(FormulaAST&&) = default;
 FormulaAST::~FormulaAST() = default;
@@ -1,15 +1,55 @@
 #pragma once
 
 #include "FormulaLexer.h"
+#include "arena.h"
 #include "common.h"
 
-#include <forward_list>
+#include <cstdint>
 #include <functional>
 #include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
 
 namespace ASTImpl {
 class Expr;
-}
+
+// Aggregate functions over ranges and scalar arguments
+enum class Function : std::uint8_t {
+    Sum,
+    Average,
+    Min,
+    Max,
+    Count,
+};
+
+// A single step of the compiled formula program. The program is stored in
+// postfix order and executed on an operand stack, so every subexpression
+// is evaluated exactly once.
+struct Instruction {
+    enum class OpCode : std::uint8_t {
+        PushNumber,  // pushes `number`
+        LoadCell,    // pushes the value of `*cell`
+        Add,
+        Subtract,
+        Multiply,
+        Divide,
+        Negate,
+        BeginAggregate,   // starts accumulating `function`
+        AggregateValue,   // pops a value into the innermost accumulator
+        AggregateRange,   // feeds the values of `*range` into the innermost accumulator
+        EndAggregate,     // pushes the result of the innermost accumulator
+    };
+
+    OpCode op;
+    union {
+        double number;
+        const Position* cell;
+        const CellRange* range;
+        Function function;
+    };
+};
+}  // namespace ASTImpl
 
 class ParsingError : public std::runtime_error {
     using std::runtime_error::runtime_error;
@@ -17,36 +57,74 @@ class ParsingError : public std::runtime_error {
 
 //using EvaluateFunc = double(*)(Position);
 using EvaluateFunc = std::function<double(Position)>;
+// Receives a batch of numeric values
+using RangeValuesConsumer = std::function<void(const double* values, size_t count)>;
+// Passes the numeric values of a range to the consumer in batches
+using GatherRangeFunc = std::function<void(const CellRange& range, const RangeValuesConsumer& consumer)>;
 
 class FormulaAST {
 public:
-    explicit FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr,
-                        std::forward_list<Position> cells);
-    FormulaAST(FormulaAST&&) = default;
-    FormulaAST& operator=(FormulaAST&&) = default;
+    // Nodes of the tree, cells and ranges are allocated in arena; cells and ranges
+    // point into the nodes that reference them.
+    explicit FormulaAST(Arena arena, const ASTImpl::Expr* root_expr,
+                        std::vector<Position*> cells,
+                        std::vector<CellRange*> ranges);
+    FormulaAST(FormulaAST&&);
+    FormulaAST& operator=(FormulaAST&&);
     ~FormulaAST();
 
-    double Execute(EvaluateFunc func) const;
+    double Execute(const EvaluateFunc& func, const GatherRangeFunc& gather) const;
     void PrintCells(std::ostream& out) const;
     void Print(std::ostream& out) const;
-    void PrintFormula(std::ostream& out) const;
+    // Cell references are printed shifted by origin, see GetRelativeFormulaKey
+    void PrintFormula(std::ostream& out, Position origin = {0, 0}) const;
 
-    std::forward_list<Position>& GetCells() {
-        return cells_;
-    }
+    // Referenced cells in ascending order, with duplicates
+    std::vector<Position> GetCells() const;
+    // Referenced ranges in the order of appearance
+    std::vector<CellRange> GetRanges() const;
+    // Adds offset to every cell and range reference
+    void ShiftReferences(Position offset);
 
-    const std::forward_list<Position>& GetCells() const {
-        return cells_;
-    }
+    // Appends the binary form of the tree: nodes in postfix order with cell
+    // references as stored, see DeserializeFormulaAST. Unlike the text, the
+    // binary form is restored without lexing or parsing.
+    void Serialize(std::string& out) const;
 
 private:
-    std::unique_ptr<ASTImpl::Expr> root_expr_;
+    void Compile();
+
+    // owns the nodes and the referenced positions, which are freed all at once
+    Arena arena_;
+    const ASTImpl::Expr* root_expr_;
+
+    // allow traversing the references without going through the whole AST;
+    // cells_ is kept sorted by position
+    std::vector<Position*> cells_;
+    std::vector<CellRange*> ranges_;
 
-    // physically stores cells so that they can be
-    // efficiently traversed without going through
-    // the whole AST
-    std::forward_list<Position> cells_;
+    // flat postfix program lowered from root_expr_; LoadCell and AggregateRange
+    // instructions point into the arena, which never moves its objects
+    std::vector<ASTImpl::Instruction> program_;
+    size_t max_stack_depth_ = 0;
+    size_t max_aggregate_depth_ = 0;
 };
 
+// Parses with the ANTLR-generated parser; kept as the reference implementation.
 FormulaAST ParseFormulaAST(std::istream& in);
+// Parses with the hand-written recursive descent parser. Builds the AST directly
+// from the text without token streams or parse trees. Throws ParsingError or
+// FormulaException on invalid input.
+FormulaAST ParseFormulaASTFast(std::string_view in);
+// Returns a key that identifies the formula up to a parallel shift of all its cell
+// references: the token sequence with each cell replaced by its offset from origin.
+// Formulas copied across cells ("=A1*B1" in C1, "=A2*B2" in C2) get equal keys
+// for their own positions and parse to equal ASTs once the offsets are applied.
+// Throws ParsingError or FormulaException if the formula cannot be lexed.
+std::string GetRelativeFormulaKey(std::string_view in, Position origin);
+// Restores a tree written by FormulaAST::Serialize. Throws ParsingError or
+// std::runtime_error if the data is malformed.
+FormulaAST DeserializeFormulaAST(std::string_view data);
+// Uses the hand-written parser and falls back to ANTLR if it rejects the input,
+// so that accepted formulas and error reporting match the grammar exactly.
 FormulaAST ParseFormulaAST(const std::string& in_str);
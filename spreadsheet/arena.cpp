@@ -0,0 +1,27 @@
+#include "arena.h"
+
+#include <algorithm>
+#include <cassert>
+
+void* Arena::Allocate(size_t size, size_t alignment) {
+    assert(alignment <= alignof(std::max_align_t));
+
+    void* result = current_;
+    if(current_ == nullptr || std::align(alignment, size, result, remaining_) == nullptr) {
+        // блок новый, поэтому выровнен под любой тип
+        const size_t block_size = std::max(next_block_size_, size);
+        blocks_.emplace_back(new std::byte[block_size]);
+        capacity_ += block_size;
+        next_block_size_ = std::min(next_block_size_ * 2, MAX_BLOCK_SIZE);
+        result = blocks_.back().get();
+        remaining_ = block_size;
+    }
+
+    current_ = static_cast<std::byte*>(result) + size;
+    remaining_ -= size;
+    return result;
+}
+
+size_t Arena::GetCapacity() const {
+    return capacity_;
+}
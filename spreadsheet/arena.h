@@ -0,0 +1,55 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// Арена для объектов с общим временем жизни. Память выделяется подряд из
+// блоков растущего размера и освобождается целиком вместе с ареной,
+// деструкторы объектов не вызываются, поэтому объекты должны быть
+// тривиально разрушаемыми. Перемещение арены не меняет адреса объектов.
+class Arena {
+public:
+    Arena() = default;
+    Arena(Arena&&) = default;
+    Arena& operator=(Arena&&) = default;
+
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+
+    void* Allocate(size_t size, size_t alignment);
+
+    template <typename T, typename... Args>
+    T* Create(Args&&... args) {
+        static_assert(std::is_trivially_destructible_v<T>);
+        return new (Allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+    }
+
+    // Копирует count элементов в арену, возвращает адрес копии
+    template <typename T>
+    T* CopyArray(const T* data, size_t count) {
+        static_assert(std::is_trivially_copyable_v<T>);
+        if(count == 0) {
+            return nullptr;
+        }
+        T* result = static_cast<T*>(Allocate(sizeof(T) * count, alignof(T)));
+        std::uninitialized_copy(data, data + count, result);
+        return result;
+    }
+
+    // Суммарный размер выделенных блоков
+    size_t GetCapacity() const;
+
+private:
+    static constexpr size_t MIN_BLOCK_SIZE = 256;
+    static constexpr size_t MAX_BLOCK_SIZE = 64 * 1024;
+
+    std::vector<std::unique_ptr<std::byte[]>> blocks_;
+    std::byte* current_ = nullptr;
+    size_t remaining_ = 0;
+    size_t next_block_size_ = MIN_BLOCK_SIZE;
+    size_t capacity_ = 0;
+};
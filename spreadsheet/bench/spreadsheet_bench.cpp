@@ -0,0 +1,270 @@
+// Замеры производительности основных операций таблицы. Для каждого замера
+// печатается время и число выделений памяти на операцию, а также пиковый
+// объём резидентной памяти процесса после замера.
+// Запуск: spreadsheet_bench [подстрока имени замера]
+#include "common.h"
+#include "formula.h"
+#include "sheet.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <memory>
+#include <new>
+#include <ostream>
+#include <random>
+#include <streambuf>
+#include <string>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/resource.h>
+#endif
+
+namespace {
+std::atomic<size_t> allocation_count{0};
+}  // namespace
+
+// Все выделения памяти процесса проходят через счётчик
+void* operator new(size_t size) {
+    allocation_count.fetch_add(1, std::memory_order_relaxed);
+    if(void* ptr = std::malloc(size == 0 ? 1 : size)) {
+        return ptr;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void* ptr) noexcept {
+    std::free(ptr);
+}
+
+void operator delete(void* ptr, size_t) noexcept {
+    std::free(ptr);
+}
+
+namespace {
+// Пиковый объём резидентной памяти в килобайтах, 0 если неизвестен
+long GetPeakRssKb() {
+#if defined(__unix__) || defined(__APPLE__)
+    rusage usage{};
+    getrusage(RUSAGE_SELF, &usage);
+#if defined(__APPLE__)
+    return usage.ru_maxrss / 1024;
+#else
+    return usage.ru_maxrss;
+#endif
+#else
+    return 0;
+#endif
+}
+
+// Поток, отбрасывающий всё записанное
+class NullBuffer : public std::streambuf {
+protected:
+    std::streamsize xsputn(const char*, std::streamsize count) override {
+        return count;
+    }
+    int overflow(int c) override {
+        return c;
+    }
+};
+
+struct Benchmark {
+    std::string name;
+    // Готовит данные вне замера и возвращает замеряемое действие вместе
+    // с числом операций в нём
+    std::function<std::pair<std::function<void()>, size_t>()> setup;
+};
+
+constexpr int REPETITIONS = 5;
+
+// Каждый замер повторяется REPETITIONS раз на новых данных, печатается
+// медиана времени и выделения последнего повтора
+void Run(const Benchmark& benchmark) {
+    std::vector<double> ns_per_op;
+    double allocations_per_op = 0;
+    for(int i = 0; i < REPETITIONS; ++i) {
+        auto [body, ops] = benchmark.setup();
+        const size_t allocations_before = allocation_count.load(std::memory_order_relaxed);
+        const auto start = std::chrono::steady_clock::now();
+        body();
+        const auto finish = std::chrono::steady_clock::now();
+        const size_t allocations = allocation_count.load(std::memory_order_relaxed) - allocations_before;
+        const double ns = std::chrono::duration<double, std::nano>(finish - start).count();
+        ns_per_op.push_back(ns / ops);
+        allocations_per_op = static_cast<double>(allocations) / ops;
+    }
+    std::nth_element(ns_per_op.begin(), ns_per_op.begin() + REPETITIONS / 2, ns_per_op.end());
+    std::printf("%-28s %12.1f ns/op %10.2f allocs/op %10ld KB peak RSS\n", benchmark.name.c_str(),
+                ns_per_op[REPETITIONS / 2], allocations_per_op, GetPeakRssKb());
+    std::fflush(stdout);
+}
+
+std::string CellName(int row, int col) {
+    return Position{row, col}.ToString();
+}
+
+// i-я позиция при заполнении листа по столбцам
+Position AtIndex(int i, int first_col = 0) {
+    return {i % Position::MAX_ROWS, first_col + i / Position::MAX_ROWS};
+}
+
+// Разбор различных формул: числа в формулах разные, поэтому общие
+// скомпилированные формулы не используются
+Benchmark ParseFormulas() {
+    return {"parse_formulas", [] {
+        constexpr int count = 20000;
+        auto texts = std::make_shared<std::vector<std::string>>();
+        std::mt19937 random(1);
+        for(int i = 0; i < count; ++i) {
+            texts->push_back("(A1+" + std::to_string(i) + ")*SUM(B2:C" + std::to_string(random() % 1000 + 3) +
+                             ",7)/(-D4-" + std::to_string(random() % 100) + ".5)");
+        }
+        return std::make_pair(std::function<void()>([texts] {
+            for(const std::string& text : *texts) {
+                ParseFormula(text);
+            }
+        }), size_t(count));
+    }};
+}
+
+// Пересчёт цепочки A1 <- A2 <- ... после изменения её начала
+Benchmark DeepChain() {
+    return {"deep_chain_evaluation", [] {
+        constexpr int length = 50000;
+        auto sheet = std::make_shared<Sheet>();
+        sheet->SetCell(AtIndex(0), "1");
+        for(int i = 1; i < length; ++i) {
+            sheet->SetCell(AtIndex(i), "=" + AtIndex(i - 1).ToString() + "+1");
+        }
+        sheet->GetCell(AtIndex(length - 1))->GetValue();
+        return std::make_pair(std::function<void()>([sheet] {
+            sheet->SetCell(AtIndex(0), "2");
+            sheet->GetCell(AtIndex(length - 1))->GetValue();
+        }), size_t(length));
+    }};
+}
+
+// Пометка устаревшими формул, ссылающихся на одну ячейку
+Benchmark WideFanOut() {
+    return {"wide_fan_out_invalidation", [] {
+        constexpr int width = 100000;
+        auto sheet = std::make_shared<Sheet>();
+        sheet->SetCell({0, 0}, "1");
+        for(int i = 0; i < width; ++i) {
+            sheet->SetCell(AtIndex(i, 1), "=A1*2");
+        }
+        sheet->Recalculate();
+        return std::make_pair(std::function<void()>([sheet] {
+            sheet->SetCell({0, 0}, "2");
+        }), size_t(width));
+    }};
+}
+
+// Слои ромбов: каждая ячейка зависит от двух соседних ячеек прошлого слоя
+Benchmark Diamonds() {
+    return {"diamond_graph", [] {
+        constexpr int width = 100;
+        constexpr int depth = 300;
+        auto sheet = std::make_shared<Sheet>();
+        for(int col = 0; col < width; ++col) {
+            sheet->SetCell({0, col}, std::to_string(col));
+        }
+        for(int row = 1; row < depth; ++row) {
+            for(int col = 0; col < width; ++col) {
+                sheet->SetCell({row, col}, "=(" + CellName(row - 1, col) + "+" +
+                                               CellName(row - 1, (col + 1) % width) + ")/2");
+            }
+        }
+        sheet->Recalculate();
+        return std::make_pair(std::function<void()>([sheet] {
+            sheet->SetCell({0, 0}, "1000");
+            sheet->Recalculate();
+        }), size_t(width * depth));
+    }};
+}
+
+// Запись ячеек, разбросанных по всему листу
+Benchmark SparseSetCell() {
+    return {"sparse_far_set_cell", [] {
+        constexpr int count = 20000;
+        auto positions = std::make_shared<std::vector<Position>>();
+        std::mt19937 random(2);
+        for(int i = 0; i < count; ++i) {
+            positions->push_back({static_cast<int>(random() % Position::MAX_ROWS),
+                                  static_cast<int>(random() % Position::MAX_COLS)});
+        }
+        positions->back() = {Position::MAX_ROWS - 1, Position::MAX_COLS - 1};
+        auto sheet = std::make_shared<Sheet>();
+        return std::make_pair(std::function<void()>([sheet, positions] {
+            for(Position pos : *positions) {
+                sheet->SetCell(pos, "text");
+            }
+        }), size_t(count));
+    }};
+}
+
+// Очистка ячеек от дальнего угла, печатаемая область каждый раз сжимается
+Benchmark ClearShrink() {
+    return {"clear_cell_shrink", [] {
+        constexpr int size = 200;
+        auto sheet = std::make_shared<Sheet>();
+        for(int i = 0; i < size; ++i) {
+            for(int k = 0; k < size; ++k) {
+                sheet->SetCell({i, k}, "x");
+            }
+        }
+        return std::make_pair(std::function<void()>([sheet] {
+            for(int i = size - 1; i >= 0; --i) {
+                for(int k = size - 1; k >= 0; --k) {
+                    sheet->ClearCell({i, k});
+                    sheet->GetPrintableSize();
+                }
+            }
+        }), size_t(size * size));
+    }};
+}
+
+// Печать значений большой таблицы из чисел, текста и формул
+Benchmark PrintLargeSheet() {
+    return {"print_values_large_sheet", [] {
+        constexpr int rows = 10000;
+        constexpr int cols = 50;
+        auto sheet = std::make_shared<Sheet>();
+        for(int row = 0; row < rows; ++row) {
+            for(int col = 0; col < cols; ++col) {
+                if(col == 0) {
+                    sheet->SetCell({row, col}, std::to_string(row * 0.37));
+                } else if(col % 3 == 0) {
+                    sheet->SetCell({row, col}, "text " + std::to_string(col));
+                } else {
+                    sheet->SetCell({row, col}, "=" + CellName(row, 0) + "*" + std::to_string(col));
+                }
+            }
+        }
+        sheet->Recalculate();
+        return std::make_pair(std::function<void()>([sheet] {
+            NullBuffer buffer;
+            std::ostream output(&buffer);
+            sheet->PrintValues(output);
+        }), size_t(rows * cols));
+    }};
+}
+}  // namespace
+
+int main(int argc, char** argv) {
+    const std::string filter = argc > 1 ? argv[1] : "";
+    const std::vector<Benchmark> benchmarks{
+        ParseFormulas(), DeepChain(), WideFanOut(), Diamonds(),
+        SparseSetCell(), ClearShrink(), PrintLargeSheet(),
+    };
+    for(const Benchmark& benchmark : benchmarks) {
+        if(benchmark.name.find(filter) != std::string::npos) {
+            Run(benchmark);
+        }
+    }
+    return 0;
+}
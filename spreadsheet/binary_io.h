@@ -0,0 +1,72 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <type_traits>
+
+// Запись и чтение значений в двоичном виде, в порядке байтов платформы
+
+template <typename T>
+void WriteBinary(std::string& out, T value) {
+    static_assert(std::is_trivially_copyable_v<T>);
+    out.append(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+// Строка записывается вместе с длиной
+inline void WriteBinaryString(std::string& out, std::string_view text) {
+    WriteBinary(out, static_cast<std::uint32_t>(text.size()));
+    out.append(text);
+}
+
+// Последовательное чтение из буфера. При выходе за конец данных бросается
+// std::runtime_error.
+class BinaryReader {
+public:
+    explicit BinaryReader(std::string_view data)
+        : data_{data} {
+    }
+
+    template <typename T>
+    T Read() {
+        static_assert(std::is_trivially_copyable_v<T>);
+        T value;
+        std::memcpy(&value, ReadBytes(sizeof(T)).data(), sizeof(T));
+        return value;
+    }
+
+    // Число элементов, каждый из которых занимает не меньше min_size байт.
+    // Число, не помещающееся в оставшиеся данные, отвергается, поэтому по
+    // нему можно выделять память
+    template <typename T>
+    size_t ReadCount(size_t min_size) {
+        const T count = Read<T>();
+        if(count > data_.size() / min_size) {
+            throw std::runtime_error("BinaryReader: count exceeds data size");
+        }
+        return static_cast<size_t>(count);
+    }
+
+    // Строка, записанная WriteBinaryString(); указывает в буфер
+    std::string_view ReadString() {
+        return ReadBytes(Read<std::uint32_t>());
+    }
+
+    std::string_view ReadBytes(size_t size) {
+        if(size > data_.size()) {
+            throw std::runtime_error("BinaryReader: unexpected end of data");
+        }
+        std::string_view result = data_.substr(0, size);
+        data_.remove_prefix(size);
+        return result;
+    }
+
+    bool AtEnd() const {
+        return data_.empty();
+    }
+
+private:
+    std::string_view data_;
+};
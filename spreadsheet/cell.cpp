@@ -1,71 +1,215 @@
 #include "cell.h"
 #include "sheet.h"
 
+#include <algorithm>
 #include <cassert>
+#include <charconv>
+#include <cmath>
 #include <iostream>
 #include <string>
 #include <optional>
+#include <stdexcept>
+#include <unordered_set>
 
 
-Cell::Cell(Sheet& sheet)
-    : sheet_{sheet}, impl_{std::make_unique<EmptyImpl>()} {
+double NumericValue::ToNumber() const {
+    if(tag == Tag::Empty) {
+        return 0.0;
+    }
+    if(std::optional<double> range_number = ToRangeNumber()) {
+        return *range_number;
+    }
+    // остаётся нечисловой текст
+    throw FormulaError(FormulaError::Category::Value);
+}
+
+std::optional<double> NumericValue::ToRangeNumber() const {
+    switch(tag) {
+        case Tag::Number:
+            return number;
+        case Tag::RefError:
+            throw FormulaError(FormulaError::Category::Ref);
+        case Tag::ValueError:
+            throw FormulaError(FormulaError::Category::Value);
+        case Tag::ArithmeticError:
+            throw FormulaError(FormulaError::Category::Arithmetic);
+        default:
+            assert(tag != Tag::Stale);
+            return std::nullopt;
+    }
+}
+
+Cell::Cell(Sheet& sheet, Position pos)
+    : sheet_{sheet}, pos_{pos}, order_{sheet.PrependToOrder()} {
 }
 
-void Cell::Set(const std::string& text, Position pos) {
+void Cell::Set(const std::string& text) {
     if(GetText() == text) {
         return;
     }
 
-    if(text[0] == '=') {
-        CheckCyclicDependences(text,pos);
+    Content content = sheet_.ParseCellText(text, pos_);
+    if(content.formula) {
+        PlaceAfterReferences(*content.formula);
     }
 
-    CacheInvalidate();
+    Apply(std::move(content));
+    InvalidateDependents();
+}
+
+Cell::Content Cell::Parse(std::string text, Position pos) {
+    Content content;
+    if(text.size() > 1 && text[0] == FORMULA_SIGN) {
+        content.formula = ParseFormula(text.substr(1), pos);
+    }
+    content.text = std::move(text);
+    return content;
+}
 
-    for(auto cell_pos : GetReferencedCells()) {
-        Cell* curr_cell = dynamic_cast<Cell*>(sheet_.GetCell(cell_pos));
+void Cell::Apply(Content content) {
+    for(auto cell_pos : GetCellReferences()) {
+        Cell* curr_cell = sheet_.GetCellPtr(cell_pos);
         if(curr_cell) {
             curr_cell->RemoveDependentCell(this);
         }
     }
+    for(const CellRange& range : GetRangeReferences()) {
+        sheet_.RemoveRangeDependent(range, this);
+    }
 
-    if(text[0] == '=' && text.size() > 1) {
-        impl_ = std::make_unique<FormulaImpl>(sheet_, text.substr(1));
-    } else if(text.size() == 0) {
-        impl_ = std::make_unique<EmptyImpl>();
+    if(content.formula) {
+        data_ = FormulaData{std::move(content.formula)};
+        dirty_ = true;
+        sheet_.AddDirtyCell(pos_);
+    } else if(content.text.size() == 0) {
+        data_ = EmptyData{};
+        dirty_ = false;
     } else {
-        impl_ = std::make_unique<TextImpl>(text);
+        data_ = TextData(std::move(content.text));
+        dirty_ = false;
+    }
+
+    for(auto cell_pos : GetCellReferences()) {
+        sheet_.GetOrCreateCell(cell_pos).AddDependentCell(this);
+    }
+    // ячейки диапазонов не создаются: зависимость от диапазона хранится
+    // одной записью в индексе
+    for(const CellRange& range : GetRangeReferences()) {
+        sheet_.AddRangeDependent(range, this);
     }
+    PublishValue();
+}
 
+void Cell::Clear() {
+    Set("");
+}
 
-    for(auto cell_pos : GetReferencedCells()) {
-        sheet_.Resize(cell_pos);
-        if(sheet_.GetUniqPtrCell(cell_pos).get() == nullptr) {
-            sheet_.GetUniqPtrCell(cell_pos) = std::make_unique<Cell>(sheet_);
+Cell::Value Cell::GetValue() const {
+    const ValueView value = GetValueView();
+    if(const auto* text = std::get_if<std::string_view>(&value)) {
+        return std::string(*text);
+    }
+    if(const double* number = std::get_if<double>(&value)) {
+        return *number;
+    }
+    return std::get<FormulaError>(value);
+}
+
+Cell::ValueView Cell::GetValueView() const {
+    EnsureComputed();
+    if(const auto* text = std::get_if<TextData>(&data_)) {
+        std::string_view value = text->text;
+        if(value[0] == ESCAPE_SIGN) {
+            value.remove_prefix(1);
         }
-        dynamic_cast<Cell*>(sheet_.GetUniqPtrCell(cell_pos).get())->AddDependentCell(this);
+        return value;
     }
+    if(const FormulaData* formula = GetFormulaData()) {
+        const FormulaInterface::Value& value = formula->GetValue(sheet_);
+        if(const double* number = std::get_if<double>(&value)) {
+            return *number;
+        }
+        return std::get<FormulaError>(value);
+    }
+    return std::string_view{};
+}
 
+double Cell::GetNumber() const {
+    EnsureComputed();
+    return GetNumericValue().ToNumber();
 }
 
-void Cell::Clear() {
-    Set("", {0,0});
+std::optional<double> Cell::GetNumberInRange() const {
+    EnsureComputed();
+    return GetNumericValue().ToRangeNumber();
 }
 
-Cell::Value Cell::GetValue() const {
-    return impl_->GetValue();
+void Cell::PublishValue() const {
+    // устаревшая формула с прежним значением бывает только в ручном режиме
+    if(dirty_ && !HasValue()) {
+        sheet_.SetNumericValue(pos_, {NumericValue::Tag::Stale});
+    } else {
+        sheet_.SetNumericValue(pos_, GetNumericValue());
+    }
+}
+
+const Cell::FormulaData* Cell::GetFormulaData() const {
+    return std::get_if<FormulaData>(&data_);
+}
+
+NumericValue Cell::GetNumericValue() const {
+    if(const auto* text = std::get_if<TextData>(&data_)) {
+        return text->numeric;
+    }
+    const FormulaData* formula = GetFormulaData();
+    if(formula == nullptr) {
+        return {};
+    }
+    const FormulaInterface::Value& value = formula->GetValue(sheet_);
+    if(const FormulaError* error = std::get_if<FormulaError>(&value)) {
+        switch(error->GetCategory()) {
+            case FormulaError::Category::Ref:
+                return {NumericValue::Tag::RefError};
+            case FormulaError::Category::Value:
+                return {NumericValue::Tag::ValueError};
+            case FormulaError::Category::Arithmetic:
+                return {NumericValue::Tag::ArithmeticError};
+        }
+    }
+    return {NumericValue::Tag::Number, std::get<double>(value)};
 }
 
 std::string Cell::GetText() const {
-    return impl_->GetText();
+    if(const auto* text = std::get_if<TextData>(&data_)) {
+        return text->text;
+    }
+    if(const FormulaData* formula = GetFormulaData()) {
+        return FORMULA_SIGN + formula->formula->GetExpression();
+    }
+    return "";
 }
 
 std::vector<Position> Cell::GetReferencedCells() const {
-    return impl_->GetReferencedCells();
+    const FormulaData* formula = GetFormulaData();
+    return formula ? formula->formula->GetReferencedCells() : std::vector<Position>{};
+}
+
+std::vector<Position> Cell::GetCellReferences() const {
+    const FormulaData* formula = GetFormulaData();
+    return formula ? formula->formula->GetCellReferences() : std::vector<Position>{};
+}
+
+std::vector<CellRange> Cell::GetRangeReferences() const {
+    const FormulaData* formula = GetFormulaData();
+    return formula ? formula->formula->GetRangeReferences() : std::vector<CellRange>{};
 }
 
 bool Cell::IsReferenced() const {
-    return !impl_->GetReferencedCells().empty();
+    return !GetCellReferences().empty() || !GetRangeReferences().empty();
+}
+
+bool Cell::IsEmpty() const {
+    return std::holds_alternative<EmptyData>(data_);
 }
 
 void Cell::AddDependentCell(Cell* cell) {
@@ -76,90 +220,258 @@ void Cell::RemoveDependentCell(Cell* cell) {
     dependent_cells_.erase(cell);
 }
 
-void Cell::CacheInvalidate() {
-    impl_->ClearCache();
-    for(Cell* cell : dependent_cells_) {
-        cell->CacheInvalidate();
-    }
+Position Cell::GetPosition() const {
+    return pos_;
 }
 
-void Cell::CheckCyclicDependences(const std::string& cell_text, Position pos) const {
-    std::unique_ptr<FormulaInterface> form = ParseFormula(cell_text.substr(1));
-    std::unordered_set<Position,PositionHasher> tmp_cells;
-    tmp_cells.insert(pos);
-    CheckCyclicDependences(form->GetReferencedCells(), tmp_cells);
+const std::unordered_set<Cell*>& Cell::GetDependentCells() const {
+    return dependent_cells_;
 }
 
-void Cell::CheckCyclicDependences(const std::vector<Position>& poses, std::unordered_set<Position,PositionHasher>& tmp_cells) const {
-    for (auto cell_pos : poses) {
-        if(tmp_cells.count(cell_pos)) {
-            throw CircularDependencyException("Circular Dependency");
-        }
-        tmp_cells.insert(cell_pos);
-        Cell* cell = dynamic_cast<Cell*>(sheet_.GetCell(cell_pos));
-        if(cell != nullptr) {
-            CheckCyclicDependences(cell->GetReferencedCells(), tmp_cells);
-        }
-    }
+std::int64_t Cell::GetOrder() const {
+    return order_;
 }
 
-std::vector<Position> Cell::Impl::GetReferencedCells() const {
-    return {};
+bool Cell::IsDirty() const {
+    return dirty_;
 }
 
-void Cell::Impl::ClearCache() {
+bool Cell::HasValue() const {
+    const FormulaData* formula = GetFormulaData();
+    return formula == nullptr || formula->cache.has_value();
 }
 
-CellInterface::Value Cell::EmptyImpl::GetValue() const {
-    return "";
+void Cell::MarkStale() const {
+    dirty_ = true;
+    sheet_.AddDirtyCell(pos_);
+    PublishValue();
 }
 
-std::string Cell::EmptyImpl::GetText() const {
-    return "";
+void Cell::EnsureComputed() const {
+    if(dirty_ && !HasValue()) {
+        sheet_.GetCounters().Add(SheetCounters::Counter::ValueCacheMisses);
+        sheet_.RecalculateCell(*this);
+    } else if(GetFormulaData() != nullptr) {
+        sheet_.GetCounters().Add(SheetCounters::Counter::ValueCacheHits);
+    }
 }
 
-Cell::TextImpl::TextImpl(std::string text) : text_{std::move(text)} {
+void Cell::InvalidateDependents() {
+    SheetCounters::Timer timer(sheet_.GetCounters(), SheetCounters::Latency::Invalidate);
+    std::uint64_t invalidated = 0;
+    std::vector<Cell*> stack(dependent_cells_.begin(), dependent_cells_.end());
+    sheet_.GetRangeDependents(pos_, stack);
+    while(!stack.empty()) {
+        Cell* cell = stack.back();
+        stack.pop_back();
+        if(cell->dirty_) {
+            continue;
+        }
+
+        cell->dirty_ = true;
+        ++invalidated;
+        // в ручном режиме до пересчёта читается прежнее значение
+        const FormulaData* formula = cell->GetFormulaData();
+        if(formula != nullptr && sheet_.GetCalculationMode() == CalculationMode::Automatic) {
+            formula->cache = std::nullopt;
+        }
+        cell->PublishValue();
+        sheet_.AddDirtyCell(cell->pos_);
+        stack.insert(stack.end(), cell->dependent_cells_.begin(), cell->dependent_cells_.end());
+        sheet_.GetRangeDependents(cell->pos_, stack);
+    }
+    sheet_.GetCounters().Add(SheetCounters::Counter::CellsInvalidated, invalidated);
 }
 
-CellInterface::Value Cell::TextImpl::GetValue() const {
-    if(text_[0] == '\'') {
-        return text_.substr(1);
+void Cell::Recompute() const {
+    if(const FormulaData* formula = GetFormulaData()) {
+        formula->cache = formula->formula->Evaluate(sheet_);
     }
-    return text_;
+    dirty_ = false;
+    PublishValue();
 }
 
-std::string Cell::TextImpl::GetText() const {
-    return text_;
+void Cell::RestoreValue(NumericValue value) {
+    const FormulaData* formula = GetFormulaData();
+    if(formula == nullptr || value.tag == NumericValue::Tag::Stale) {
+        return;
+    }
+    switch(value.tag) {
+        case NumericValue::Tag::Number:
+            formula->cache = value.number;
+            break;
+        case NumericValue::Tag::RefError:
+            formula->cache = FormulaError(FormulaError::Category::Ref);
+            break;
+        case NumericValue::Tag::ValueError:
+            formula->cache = FormulaError(FormulaError::Category::Value);
+            break;
+        case NumericValue::Tag::ArithmeticError:
+            formula->cache = FormulaError(FormulaError::Category::Arithmetic);
+            break;
+        default:
+            throw std::invalid_argument("Cell::RestoreValue: not a formula value");
+    }
+    dirty_ = false;
+    PublishValue();
 }
 
-Cell::FormulaImpl::FormulaImpl(const SheetInterface& sheet,std::string formula) :
-    sheet_{sheet}, formula_{std::move(ParseFormula(std::string(formula)))} {\
+const FormulaInterface* Cell::GetFormula() const {
+    const FormulaData* formula = GetFormulaData();
+    return formula ? formula->formula.get() : nullptr;
 }
 
-CellInterface::Value Cell::FormulaImpl::GetValue() const {
-    if(cache_ != std::nullopt) {
-        return cache_.value();
+void Cell::PlaceAfterReferences(const FormulaInterface& formula) {
+    SheetCounters::Timer timer(sheet_.GetCounters(), SheetCounters::Latency::CycleCheck);
+    const std::vector<Position> cells = formula.GetCellReferences();
+    const std::vector<CellRange> ranges = formula.GetRangeReferences();
+    for(const Position cell_pos : cells) {
+        if(cell_pos == pos_) {
+            throw CircularDependencyException("Circular Dependency");
+        }
+    }
+    for(const CellRange& range : ranges) {
+        if(range.Contains(pos_)) {
+            throw CircularDependencyException("Circular Dependency");
+        }
+    }
+
+    // на ячейку без зависимых никто не ссылается, её можно просто
+    // поставить в конец порядка
+    std::vector<Cell*> stack;
+    GetDependents(stack);
+    if(stack.empty()) {
+        order_ = sheet_.AppendToOrder();
+        return;
+    }
+
+    // Алгоритм Пирса-Келли. Новые рёбра ведут из аргументов в эту ячейку,
+    // нарушают порядок только аргументы, стоящие после неё. Цикл возникает,
+    // если какой-то из них достижим из этой ячейки; искать его достаточно
+    // среди ячеек, стоящих не дальше самого позднего из таких аргументов.
+    std::vector<Cell*> arguments;
+    GetArguments(cells, ranges, arguments);
+    const std::int64_t lower = order_;
+    std::int64_t upper = lower;
+    std::unordered_set<const Cell*> late_arguments;
+    for(const Cell* cell : arguments) {
+        if(cell->order_ > lower) {
+            late_arguments.insert(cell);
+            upper = std::max(upper, cell->order_);
+        }
+    }
+    if(late_arguments.empty()) {
+        return;
+    }
+
+    // прямой обход от ячейки по зависимым в пределах (lower, upper]
+    std::unordered_set<const Cell*> visited{this};
+    std::vector<Cell*> forward{this};
+    while(!stack.empty()) {
+        Cell* cell = stack.back();
+        stack.pop_back();
+        if(cell->order_ > upper) {
+            continue;
+        }
+        if(late_arguments.count(cell)) {
+            throw CircularDependencyException("Circular Dependency");
+        }
+        if(visited.insert(cell).second) {
+            forward.push_back(cell);
+            cell->GetDependents(stack);
+        }
     }
 
-    FormulaInterface::Value eval = formula_->Evaluate(sheet_);
+    // обратный обход от поздних аргументов по их аргументам в пределах
+    // (lower, upper]; множества не пересекаются, иначе был бы найден цикл
+    std::vector<Cell*> backward;
+    for(const Cell* cell : late_arguments) {
+        stack.push_back(const_cast<Cell*>(cell));
+    }
+    visited.clear();
+    while(!stack.empty()) {
+        Cell* cell = stack.back();
+        stack.pop_back();
+        if(cell->order_ <= lower || !visited.insert(cell).second) {
+            continue;
+        }
+        backward.push_back(cell);
+        cell->GetArguments(cell->GetCellReferences(), cell->GetRangeReferences(), stack);
+    }
 
-    if(std::holds_alternative<double>(eval)) {
-        cache_  = std::get<double>(eval);
+    // найденные ячейки занимают те же места в порядке: сначала обратное
+    // множество, затем прямое, внутри каждого прежний порядок сохраняется
+    auto by_order = [](const Cell* lhs, const Cell* rhs) {
+        return lhs->order_ < rhs->order_;
+    };
+    std::sort(backward.begin(), backward.end(), by_order);
+    std::sort(forward.begin(), forward.end(), by_order);
+    std::vector<std::int64_t> orders;
+    orders.reserve(backward.size() + forward.size());
+    for(const auto* part : {&backward, &forward}) {
+        for(const Cell* cell : *part) {
+            orders.push_back(cell->order_);
+        }
     }
-    if(std::holds_alternative<FormulaError>(eval)) {
-        cache_ =  std::get<FormulaError>(eval);
+    std::sort(orders.begin(), orders.end());
+    size_t next = 0;
+    for(auto* part : {&backward, &forward}) {
+        for(Cell* cell : *part) {
+            cell->order_ = orders[next++];
+        }
     }
-    return cache_.value();
 }
 
-std::string Cell::FormulaImpl::GetText() const {
-    return {'=' + formula_->GetExpression()};
+void Cell::GetArguments(const std::vector<Position>& cells, const std::vector<CellRange>& ranges,
+                        std::vector<Cell*>& result) const {
+    for(const Position cell_pos : cells) {
+        Cell* cell = sheet_.GetCellPtr(cell_pos);
+        if(cell != nullptr) {
+            result.push_back(cell);
+        }
+    }
+    for(const CellRange& range : ranges) {
+        for(Cell* cell : sheet_.GetCellsInRange(range)) {
+            result.push_back(cell);
+        }
+    }
+}
+
+void Cell::GetDependents(std::vector<Cell*>& result) const {
+    result.insert(result.end(), dependent_cells_.begin(), dependent_cells_.end());
+    sheet_.GetRangeDependents(pos_, result);
+}
+
+namespace {
+// Число, записанное текстом целиком, без пробелов и знака плюс
+std::optional<double> ParseNumber(std::string_view text) {
+    double number;
+    auto [end, ec] = std::from_chars(text.data(), text.data() + text.size(), number);
+    if(text.empty() || ec != std::errc() || end != text.data() + text.size() || !std::isfinite(number)) {
+        return std::nullopt;
+    }
+    return number;
 }
+}  // namespace
 
-std::vector<Position> Cell::FormulaImpl::GetReferencedCells() const {
-    return formula_->GetReferencedCells();
+Cell::TextData::TextData(std::string text) : text{std::move(text)} {
+    std::string_view value = this->text;
+    if(value[0] == ESCAPE_SIGN) {
+        value.remove_prefix(1);
+    }
+    // пустой текст (например, из одного апострофа) равен нулю, как пустая ячейка
+    if(value.empty()) {
+        numeric = {NumericValue::Tag::Empty};
+    } else if(std::optional<double> number = ParseNumber(value)) {
+        numeric = {NumericValue::Tag::Number, *number};
+    } else {
+        numeric = {NumericValue::Tag::Text};
+    }
 }
 
-void Cell::FormulaImpl::ClearCache() {
-    cache_ = std::nullopt;
+const FormulaInterface::Value& Cell::FormulaData::GetValue(const SheetInterface& sheet) const {
+    if(!cache) {
+        cache = formula->Evaluate(sheet);
+    }
+    return *cache;
 }
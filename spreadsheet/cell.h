@@ -3,12 +3,39 @@
 #include "common.h"
 #include "formula.h"
 
+#include <cstdint>
 #include <functional>
 #include <memory>
 #include <optional>
+#include <string_view>
 #include <unordered_set>
+#include <variant>
 
 class Sheet;
+
+// Значение ячейки в том виде, в каком его читают формулы. Хранилище ячеек
+// держит такие значения по столбцам рядом с самими ячейками.
+struct NumericValue {
+    enum class Tag : std::uint8_t {
+        Empty,            // пустая ячейка или пустой текст
+        Number,
+        Text,             // текст, не являющийся числом
+        Stale,            // формула, которую нужно пересчитать
+        RefError,
+        ValueError,
+        ArithmeticError,
+    };
+
+    Tag tag = Tag::Empty;
+    double number = 0;
+
+    // Число для формулы: пустое значение равно нулю, для текста бросается
+    // FormulaError категории Value, ошибки бросаются как есть
+    double ToNumber() const;
+    // Число для диапазона: пустое значение и текст пропускаются
+    std::optional<double> ToRangeNumber() const;
+};
+
 class PositionHasher {
 public:
     size_t operator()(const Position& pos) const  {
@@ -18,68 +45,122 @@ public:
 
 class Cell : public CellInterface {
 public:
-    Cell(Sheet& sheet);
+    // Разобранное содержимое ячейки, готовое к установке
+    struct Content {
+        std::string text;
+        std::unique_ptr<FormulaInterface> formula;
+    };
 
-    void Set(const std::string& text, Position pos);
+    Cell(Sheet& sheet, Position pos);
+
+    void Set(const std::string& text);
     void Clear();
 
+    // Разбирает текст ячейки. Бросает FormulaException, если формула
+    // синтаксически некорректна.
+    static Content Parse(std::string text, Position pos);
+    // Устанавливает разобранное содержимое и перестраивает связи с
+    // ячейками, на которые ссылается формула. Циклы не проверяются, зависимые
+    // ячейки не помечаются устаревшими.
+    void Apply(Content content);
+
     Value GetValue() const override;
+    // Значение ячейки без копирования текста. Ссылка на текст действительна,
+    // пока содержимое ячейки не изменится.
+    using ValueView = std::variant<std::string_view, double, FormulaError>;
+    ValueView GetValueView() const;
+    // Значение ячейки в виде числа для формул. Пустая ячейка равна нулю,
+    // для текста, не являющегося числом, бросается FormulaError категории
+    // Value, ошибка формулы бросается как есть.
+    double GetNumber() const;
+    // То же для ячейки диапазона: пустая ячейка и нечисловой текст
+    // пропускаются, возвращается std::nullopt
+    std::optional<double> GetNumberInRange() const;
     std::string GetText() const override;
     std::vector<Position> GetReferencedCells() const override;
+    // Ссылки формулы без раскрытия диапазонов
+    std::vector<Position> GetCellReferences() const;
+    std::vector<CellRange> GetRangeReferences() const;
     bool IsReferenced() const;
-    void CacheInvalidate();
-    void CheckCyclicDependences(const std::string& cell_text, Position pos) const;
+    bool IsEmpty() const;
+    // Готовит запись формулы в ячейку: переставляет ячейку в топологическом
+    // порядке после ячеек, на которые ссылается formula. Если formula
+    // образовала бы цикл, бросает CircularDependencyException, порядок не
+    // меняется.
+    void PlaceAfterReferences(const FormulaInterface& formula);
+
+    Position GetPosition() const;
+    // Ячейки, ссылающиеся на данную по отдельности. Формулы, ссылающиеся на
+    // диапазоны, хранятся в индексе диапазонов таблицы.
+    const std::unordered_set<Cell*>& GetDependentCells() const;
+    // Место ячейки в топологическом порядке: ячейка идёт после всех ячеек,
+    // на которые ссылается её формула
+    std::int64_t GetOrder() const;
+
+    // Ячейка-формула, значение которой устарело и должно быть пересчитано.
+    // В ручном режиме таблицы GetValue() такой ячейки возвращает последнее
+    // вычисленное значение.
+    bool IsDirty() const;
+    // Значение вычислено (для формулы) или не требует вычисления
+    bool HasValue() const;
+    // Оставляет вычисленную формулу устаревшей: её значение получено по
+    // устаревшим аргументам
+    void MarkStale() const;
+    // Помечает устаревшими все ячейки, транзитивно зависящие от данной.
+    // Обход останавливается на уже помеченных ячейках: все зависимые от
+    // них ячейки к этому моменту тоже помечены.
+    void InvalidateDependents();
+    // Вычисляет формулу заново. Ячейки, от которых она зависит, должны быть
+    // уже пересчитаны.
+    void Recompute() const;
+    // Устанавливает ранее вычисленное значение формулы без пересчёта (при
+    // загрузке снимка). Значение Stale оставляет формулу устаревшей.
+    void RestoreValue(NumericValue value);
+
+    // Формула ячейки или nullptr
+    const FormulaInterface* GetFormula() const;
 
 private:
-    class Impl {
-    public:
-        virtual ~Impl() = default;
-        virtual CellInterface::Value GetValue() const = 0;
-        virtual std::string GetText() const = 0;
-        virtual std::vector<Position> GetReferencedCells() const;
-        void ClearCache();
-
+    // Содержимое ячейки хранится прямо в ней в виде одного из трёх
+    // вариантов, тип проверяется по индексу варианта, без виртуальных вызовов
+    struct EmptyData {
     };
 
-    class EmptyImpl : public Impl {
-    public:
-        EmptyImpl() = default;
-        virtual CellInterface::Value GetValue() const;
-        virtual std::string GetText() const;
+    struct TextData {
+        explicit TextData(std::string text);
 
+        std::string text;
+        // число, записанное текстом, разбирается один раз при установке
+        NumericValue numeric;
     };
 
-    class TextImpl : public Impl {
-    public:
-        TextImpl(std::string text);
-        virtual CellInterface::Value GetValue() const;
-        virtual std::string GetText() const;
+    struct FormulaData {
+        // Значение формулы, вычисляется при первом обращении
+        const FormulaInterface::Value& GetValue(const SheetInterface& sheet) const;
 
-    private:
-        std::string text_;
+        std::unique_ptr<FormulaInterface> formula;
+        mutable std::optional<FormulaInterface::Value> cache = std::nullopt;
     };
 
-    class FormulaImpl : public Impl {
-    public:
-        FormulaImpl(const SheetInterface& sheet,std::string formula);
-        virtual ~FormulaImpl() = default;
-        virtual CellInterface::Value GetValue() const;
-        virtual std::string GetText() const;
-        virtual std::vector<Position> GetReferencedCells() const;
-        void ClearCache();
-
-    private:
-        const SheetInterface& sheet_;
-        std::unique_ptr<FormulaInterface> formula_;
-        mutable std::optional<CellInterface::Value> cache_ = std::nullopt;
-    };
-
-private:
     Sheet& sheet_;
-    std::unique_ptr<Impl> impl_;
+    Position pos_;
+    std::variant<EmptyData, TextData, FormulaData> data_;
     std::unordered_set<Cell*> dependent_cells_;
-
-    void CheckCyclicDependences(const std::vector<Position>& poses, std::unordered_set<Position,PositionHasher>& tmp_cells) const;
+    mutable bool dirty_ = false;
+    std::int64_t order_;
+
+    // Существующие ячейки, на которые ссылаются переданные ссылки
+    void GetArguments(const std::vector<Position>& cells, const std::vector<CellRange>& ranges,
+                      std::vector<Cell*>& result) const;
+    // Ячейки, формулы которых ссылаются на данную, возможно с повторами
+    void GetDependents(std::vector<Cell*>& result) const;
+    const FormulaData* GetFormulaData() const;
+    // Значение вычисленной формулы или текста для формул
+    NumericValue GetNumericValue() const;
+    // Пересчитывает устаревшую формулу перед чтением значения
+    void EnsureComputed() const;
+    // Передаёт текущее значение в столбцовое хранилище таблицы
+    void PublishValue() const;
     void AddDependentCell(Cell*);
     void RemoveDependentCell(Cell*);
 };
@@ -0,0 +1,260 @@
+#include "cell_storage.h"
+
+#include <algorithm>
+#include <cassert>
+
+void OccupancyIndex::Add(Position pos) {
+    Add(row_counts_, pos.row);
+    Add(col_counts_, pos.col);
+}
+
+void OccupancyIndex::Remove(Position pos) {
+    Remove(row_counts_, pos.row);
+    Remove(col_counts_, pos.col);
+}
+
+Size OccupancyIndex::GetBounds() const {
+    if(row_counts_.empty()) {
+        return {0, 0};
+    }
+    return {row_counts_.rbegin()->first + 1, col_counts_.rbegin()->first + 1};
+}
+
+void OccupancyIndex::Add(std::map<int, int>& counts, int index) {
+    ++counts[index];
+}
+
+void OccupancyIndex::Remove(std::map<int, int>& counts, int index) {
+    auto it = counts.find(index);
+    assert(it != counts.end());
+    if(--it->second == 0) {
+        counts.erase(it);
+    }
+}
+
+CellStorage::~CellStorage() {
+    for(auto& [key, tile] : tiles_) {
+        for(Cell* cell : tile->cells) {
+            if(cell != nullptr) {
+                pool_.Destroy(cell);
+            }
+        }
+    }
+}
+
+Cell* CellStorage::Get(Position pos) const {
+    auto it = tiles_.find(GetTileKey(pos));
+    if(it == tiles_.end()) {
+        return nullptr;
+    }
+    return it->second->cells[GetIndexInTile(pos)];
+}
+
+Cell& CellStorage::Create(Sheet& sheet, Position pos) {
+    auto& tile = tiles_[GetTileKey(pos)];
+    if(!tile) {
+        tile = std::make_unique<Tile>();
+    }
+
+    auto& slot = tile->cells[GetIndexInTile(pos)];
+    assert(slot == nullptr);
+    slot = pool_.Create(sheet, pos);
+
+    const int col = pos.col % TILE_COLS;
+    if(tile->column_counts[col]++ == 0) {
+        tile->columns[col] = std::make_unique<ColumnValues>();
+    }
+    ++tile->count;
+    tile->changed.store(true, std::memory_order_relaxed);
+    ++cell_count_;
+    occupancy_.Add(pos);
+    return *slot;
+}
+
+void CellStorage::Erase(Position pos) {
+    auto it = tiles_.find(GetTileKey(pos));
+    if(it == tiles_.end()) {
+        return;
+    }
+
+    auto& slot = it->second->cells[GetIndexInTile(pos)];
+    if(slot == nullptr) {
+        return;
+    }
+    pool_.Destroy(slot);
+    slot = nullptr;
+    const int col = pos.col % TILE_COLS;
+    if(--it->second->column_counts[col] == 0) {
+        it->second->columns[col].reset();
+    } else {
+        it->second->columns[col]->tags[pos.row % TILE_ROWS] = NumericValue::Tag::Empty;
+    }
+    it->second->changed.store(true, std::memory_order_relaxed);
+
+    --cell_count_;
+    occupancy_.Remove(pos);
+    if(--it->second->count == 0) {
+        removed_tiles_.push_back(it->first);
+        tiles_.erase(it);
+    }
+}
+
+Size CellStorage::GetBounds() const {
+    return occupancy_.GetBounds();
+}
+
+size_t CellStorage::GetCellCount() const {
+    return cell_count_;
+}
+
+size_t CellStorage::GetCellCapacity() const {
+    return pool_.GetCapacity();
+}
+
+template <typename Func>
+void CellStorage::ForEachTileInRange(Position first, Position last, Func func) const {
+    const int first_tile_row = first.row / TILE_ROWS;
+    const int last_tile_row = last.row / TILE_ROWS;
+    const int first_tile_col = first.col / TILE_COLS;
+    const int last_tile_col = last.col / TILE_COLS;
+    const size_t range_tiles = static_cast<size_t>(last_tile_row - first_tile_row + 1) *
+                               (last_tile_col - first_tile_col + 1);
+
+    // обходим либо все плитки диапазона, либо все существующие плитки,
+    // смотря что меньше
+    if(range_tiles <= tiles_.size()) {
+        for(int tile_row = first_tile_row; tile_row <= last_tile_row; ++tile_row) {
+            for(int tile_col = first_tile_col; tile_col <= last_tile_col; ++tile_col) {
+                const int key = tile_row * TILES_PER_ROW + tile_col;
+                auto it = tiles_.find(key);
+                if(it != tiles_.end()) {
+                    func(key, *it->second);
+                }
+            }
+        }
+    } else {
+        for(const auto& [key, tile] : tiles_) {
+            const int tile_row = key / TILES_PER_ROW;
+            const int tile_col = key % TILES_PER_ROW;
+            if(tile_row >= first_tile_row && tile_row <= last_tile_row &&
+                tile_col >= first_tile_col && tile_col <= last_tile_col) {
+                func(key, *tile);
+            }
+        }
+    }
+}
+
+std::vector<Position> CellStorage::GetPositionsInRange(Position first, Position last) const {
+    std::vector<Position> result;
+    ForEachTileInRange(first, last, [&](int key, const Tile& tile) {
+        CollectTilePositions(key, tile, first, last, result);
+    });
+    return result;
+}
+
+size_t CellStorage::CountCellsInRange(Position first, Position last) const {
+    size_t count = 0;
+    ForEachTileInRange(first, last, [&](int key, const Tile& tile) {
+        const int top = key / TILES_PER_ROW * TILE_ROWS;
+        const int left = key % TILES_PER_ROW * TILE_COLS;
+        const int row_begin = std::max(first.row, top);
+        const int row_end = std::min(last.row + 1, top + TILE_ROWS);
+        const int col_begin = std::max(first.col, left);
+        const int col_end = std::min(last.col + 1, left + TILE_COLS);
+        if(row_end - row_begin == TILE_ROWS && col_end - col_begin == TILE_COLS) {
+            count += tile.count;
+            return;
+        }
+        for(int row = row_begin; row < row_end; ++row) {
+            for(int col = col_begin; col < col_end; ++col) {
+                count += tile.cells[GetIndexInTile({row, col})] != nullptr;
+            }
+        }
+    });
+    return count;
+}
+
+NumericValue CellStorage::GetNumericValue(Position pos) const {
+    auto it = tiles_.find(GetTileKey(pos));
+    if(it == tiles_.end()) {
+        return {};
+    }
+    const ColumnValues* values = it->second->columns[pos.col % TILE_COLS].get();
+    if(values == nullptr) {
+        return {};
+    }
+    const int row = pos.row % TILE_ROWS;
+    return {values->tags[row], values->numbers[row]};
+}
+
+void CellStorage::SetNumericValue(Position pos, NumericValue value) {
+    auto it = tiles_.find(GetTileKey(pos));
+    assert(it != tiles_.end());
+    // значения столбца созданы вместе с ячейкой, поэтому параллельные
+    // вызовы не выделяют память
+    ColumnValues& values = *it->second->columns[pos.col % TILE_COLS];
+    const int row = pos.row % TILE_ROWS;
+    values.tags[row] = value.tag;
+    values.numbers[row] = value.number;
+    it->second->changed.store(true, std::memory_order_relaxed);
+}
+
+void CellStorage::TakeChangedTiles(const std::function<void(int key, const TileCells* cells)>& func) {
+    for(int key : removed_tiles_) {
+        // плитка могла появиться заново, тогда она отмечена изменённой
+        if(tiles_.count(key) == 0) {
+            func(key, nullptr);
+        }
+    }
+    removed_tiles_.clear();
+    for(auto& [key, tile] : tiles_) {
+        if(tile->changed.exchange(false, std::memory_order_relaxed)) {
+            func(key, &tile->cells);
+        }
+    }
+}
+
+void CellStorage::ForEachColumnSegment(Position first, Position last,
+                                       const ColumnSegmentFunc& func) const {
+    ForEachTileInRange(first, last, [&](int key, const Tile& tile) {
+        const int top = key / TILES_PER_ROW * TILE_ROWS;
+        const int left = key % TILES_PER_ROW * TILE_COLS;
+        const int row_begin = std::max(first.row, top);
+        const int row_end = std::min(last.row + 1, top + TILE_ROWS);
+        const int col_begin = std::max(first.col, left);
+        const int col_end = std::min(last.col + 1, left + TILE_COLS);
+        for(int col = col_begin; col < col_end; ++col) {
+            const ColumnValues* values = tile.columns[col - left].get();
+            if(values == nullptr) {
+                continue;
+            }
+            const int row = row_begin - top;
+            func({row_begin, col}, &values->numbers[row], &values->tags[row], row_end - row_begin);
+        }
+    });
+}
+
+void CellStorage::CollectTilePositions(int key, const Tile& tile, Position first, Position last,
+                                       std::vector<Position>& result) const {
+    const int top = key / TILES_PER_ROW * TILE_ROWS;
+    const int left = key % TILES_PER_ROW * TILE_COLS;
+    const int row_begin = std::max(first.row, top);
+    const int row_end = std::min(last.row + 1, top + TILE_ROWS);
+    const int col_begin = std::max(first.col, left);
+    const int col_end = std::min(last.col + 1, left + TILE_COLS);
+    for(int row = row_begin; row < row_end; ++row) {
+        for(int col = col_begin; col < col_end; ++col) {
+            if(tile.cells[GetIndexInTile({row, col})] != nullptr) {
+                result.push_back({row, col});
+            }
+        }
+    }
+}
+
+int CellStorage::GetTileKey(Position pos) {
+    return (pos.row / TILE_ROWS) * TILES_PER_ROW + pos.col / TILE_COLS;
+}
+
+int CellStorage::GetIndexInTile(Position pos) {
+    return (pos.row % TILE_ROWS) * TILE_COLS + pos.col % TILE_COLS;
+}
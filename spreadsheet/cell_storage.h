@@ -0,0 +1,132 @@
+#pragma once
+
+#include "cell.h"
+#include "common.h"
+#include "object_pool.h"
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+// Число занятых позиций в каждой непустой строке и в каждом непустом
+// столбце. Ограничивающий прямоугольник поддерживается за O(log n) на
+// добавление и удаление позиции.
+class OccupancyIndex {
+public:
+    void Add(Position pos);
+    void Remove(Position pos);
+
+    Size GetBounds() const;
+
+private:
+    static void Add(std::map<int, int>& counts, int index);
+    static void Remove(std::map<int, int>& counts, int index);
+
+    std::map<int, int> row_counts_;
+    std::map<int, int> col_counts_;
+};
+
+// Разреженное хранилище ячеек. Лист делится на плитки фиксированного
+// размера, которые создаются только при появлении в них первой ячейки и
+// удаляются вместе с последней, поэтому память пропорциональна числу
+// заполненных ячеек, а не площади листа.
+// Кроме ячеек плитка хранит их значения для формул (NumericValue) по
+// столбцам: числа столбца плитки лежат подряд, отдельно от типов, поэтому
+// формулы читают их без обращения к самим ячейкам, а диапазоны - потоком.
+// Значения столбца плитки создаются вместе с первой его ячейкой и удаляются
+// с последней, так что одиночная ячейка не несёт значений всей плитки.
+// Сами ячейки выделяются из пула хранилища, а не по одной из общей кучи.
+class CellStorage {
+public:
+    static constexpr int TILE_ROWS = 64;
+    static constexpr int TILE_COLS = 16;
+
+    CellStorage() = default;
+    CellStorage(const CellStorage&) = delete;
+    CellStorage& operator=(const CellStorage&) = delete;
+    ~CellStorage();
+
+    Cell* Get(Position pos) const;
+    // Создаёт пустую ячейку листа sheet, позиция не должна быть занята
+    Cell& Create(Sheet& sheet, Position pos);
+    void Erase(Position pos);
+
+    // Ограничивающий прямоугольник всех хранимых ячеек
+    Size GetBounds() const;
+    size_t GetCellCount() const;
+    // Число мест для ячеек в пуле, включая освободившиеся
+    size_t GetCellCapacity() const;
+
+    // Позиции всех хранимых ячеек в прямоугольнике [first, last]
+    std::vector<Position> GetPositionsInRange(Position first, Position last) const;
+    // Число хранимых ячеек в прямоугольнике [first, last]; плитки, целиком
+    // лежащие в нём, не просматриваются
+    size_t CountCellsInRange(Position first, Position last) const;
+
+    using TileCells = std::array<Cell*, TILE_ROWS * TILE_COLS>;
+    // Плитка, содержащая pos, и место pos в ней
+    static int GetTileKey(Position pos);
+    static int GetIndexInTile(Position pos);
+    // Вызывает func(key, cells) для каждой плитки, изменившейся после
+    // прошлого вызова: в ней появились или удалены ячейки либо изменились
+    // значения. Для удалённых плиток cells == nullptr.
+    void TakeChangedTiles(const std::function<void(int key, const TileCells* cells)>& func);
+
+    // Значение для формул ячейки pos, Empty для отсутствующей ячейки
+    NumericValue GetNumericValue(Position pos) const;
+    // Ячейка pos должна существовать. Вызовы для разных позиций можно
+    // выполнять параллельно.
+    void SetNumericValue(Position pos, NumericValue value);
+
+    using ColumnSegmentFunc = std::function<void(Position top, const double* numbers,
+                                                 const NumericValue::Tag* tags, int count)>;
+    // Вызывает func для каждого отрезка столбца плитки, пересекающегося с
+    // прямоугольником [first, last] и содержащего ячейки: count значений
+    // начиная с позиции top вниз по столбцу. Отсутствующим ячейкам
+    // соответствует тип Empty.
+    void ForEachColumnSegment(Position first, Position last, const ColumnSegmentFunc& func) const;
+
+private:
+    static constexpr int TILES_PER_ROW = Position::MAX_COLS / TILE_COLS;
+
+    // Значения для формул одного столбца плитки
+    struct ColumnValues {
+        std::array<double, TILE_ROWS> numbers{};
+        std::array<NumericValue::Tag, TILE_ROWS> tags{};
+    };
+
+    struct Tile {
+        TileCells cells{};
+        // значения столбцов, в которых есть ячейки
+        std::array<std::unique_ptr<ColumnValues>, TILE_COLS> columns;
+        std::array<std::uint8_t, TILE_COLS> column_counts{};
+        int count = 0;
+        // изменения с прошлого TakeChangedTiles(); значения меняются и при
+        // параллельном пересчёте
+        std::atomic<bool> changed{true};
+    };
+
+    // Плитка из одной ячейки не должна быть заметно больше указателей на
+    // ячейки, иначе разреженный лист занимает память по числу плиток
+    static_assert(sizeof(Tile) <= sizeof(TileCells) + sizeof(ColumnValues));
+
+    // Вызывает func(key, tile) для существующих плиток, пересекающихся с
+    // прямоугольником [first, last]
+    template <typename Func>
+    void ForEachTileInRange(Position first, Position last, Func func) const;
+
+    void CollectTilePositions(int key, const Tile& tile, Position first, Position last,
+                              std::vector<Position>& result) const;
+
+    ObjectPool<Cell> pool_;
+    std::unordered_map<int, std::unique_ptr<Tile>> tiles_;
+    // плитки, удалённые после прошлого TakeChangedTiles()
+    std::vector<int> removed_tiles_;
+    size_t cell_count_ = 0;
+    OccupancyIndex occupancy_;
+};
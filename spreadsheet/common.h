@@ -1,5 +1,6 @@
 #pragma once
 
+#include <functional>
 #include <iosfwd>
 #include <memory>
 #include <stdexcept>
@@ -26,6 +27,18 @@ struct Position {
     static const Position NONE;
 };
 
+// Прямоугольник ячеек с углами first и last включительно,
+// first.row <= last.row и first.col <= last.col
+struct CellRange {
+    Position first;
+    Position last;
+
+    bool Contains(Position pos) const {
+        return pos.row >= first.row && pos.row <= last.row &&
+               pos.col >= first.col && pos.col <= last.col;
+    }
+};
+
 struct Size {
     int rows = 0;
     int cols = 0;
@@ -161,6 +174,19 @@ public:
     // соответственно. Пустая ячейка представляется пустой строкой в любом случае.
     virtual void PrintValues(std::ostream& output) const = 0;
     virtual void PrintTexts(std::ostream& output) const = 0;
+
+    // Возвращает значение ячейки в виде числа для вычисления формул. Пустая
+    // ячейка равна нулю, текст должен быть записью числа, иначе бросается
+    // FormulaError категории Value. Ошибка формулы в ячейке бросается как есть.
+    virtual double GetCellNumber(Position pos) const = 0;
+
+    // Передаёт числовые значения ячеек прямоугольника с углами first и last
+    // включительно в consumer порциями. Пустые ячейки и текст, который не
+    // является числом, пропускаются. Если значение какой-то ячейки - ошибка,
+    // бросается эта ошибка (FormulaError).
+    virtual void GatherRangeValues(
+        Position first, Position last,
+        const std::function<void(const double* values, size_t count)>& consumer) const = 0;
 };
 
 // Создаёт готовую к работе пустую таблицу.
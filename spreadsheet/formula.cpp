@@ -6,67 +6,134 @@
 #include <algorithm>
 #include <cassert>
 #include <cctype>
+#include <mutex>
 #include <sstream>
+#include <unordered_map>
 
 using namespace std::literals;
 
 std::ostream& operator<<(std::ostream& output, FormulaError fe) {
-    return output << "#ARITHM!";
+    return output << fe.ToString();
 }
 
 namespace {
-class Formula : public FormulaInterface {
-public:
-    explicit Formula(std::string expression) try : ast_{ParseFormulaAST(std::move(expression))} {
-        for (const auto cell : ast_.GetCells()) {
-            referenced_cells_.push_back(cell);
+// Формула в относительной форме: ссылки на ячейки хранятся как смещения от
+// ячейки, в которой записана формула. Общая для всех копий формулы.
+struct CompiledFormula {
+    explicit CompiledFormula(FormulaAST formula_ast) : ast{std::move(formula_ast)} {
+        for (const auto cell : ast.GetCells()) {
+            referenced_offsets.push_back(cell);
+        }
+        auto uniq_end = std::unique(referenced_offsets.begin(), referenced_offsets.end());
+        referenced_offsets.erase(uniq_end,referenced_offsets.end());
+
+        for (const CellRange& range : ast.GetRanges()) {
+            auto same = [&range](const CellRange& other) {
+                return other.first == range.first && other.last == range.last;
+            };
+            if (std::none_of(range_offsets.begin(), range_offsets.end(), same)) {
+                range_offsets.push_back(range);
+            }
         }
-        auto uniq_end = std::unique(referenced_cells_.begin(), referenced_cells_.end());
-        referenced_cells_.erase(uniq_end,referenced_cells_.end());
-    } catch(std::exception &) {
-        throw FormulaException("ParseFormula error");
     }
 
-    FormulaInterface::Value Evaluate(const SheetInterface& sheet) const override {
-        FormulaInterface::Value result;
+    FormulaAST ast;
+    // ячейки, на которые формула ссылается по отдельности
+    std::vector<Position> referenced_offsets;
+    std::vector<CellRange> range_offsets;
+};
 
-        auto Exec = [&sheet](const Position pos) {
-            if (!pos.IsValid()) {
-                throw FormulaError(FormulaError::Category::Ref);
+// Кэш скомпилированных формул по ключу относительной формы. Хранит слабые
+// ссылки, поэтому формула освобождается вместе с последней её копией.
+class FormulaCache {
+public:
+    std::shared_ptr<const CompiledFormula> Get(const std::string& expression, Position origin) {
+        std::string key;
+        try {
+            key = GetRelativeFormulaKey(expression, origin);
+        } catch (const std::exception&) {
+            // полный разбор сообщит об ошибке
+            return Compile(expression, origin);
+        }
+
+        {
+            std::lock_guard lock(mutex_);
+            auto it = entries_.find(key);
+            if (it != entries_.end()) {
+                if (auto compiled = it->second.lock()) {
+                    return compiled;
+                }
             }
-            double result;
+        }
 
-            auto cell = sheet.GetCell(pos);
+        auto compiled = Compile(expression, origin);
 
-            if (cell == nullptr) {
-                return 0.0;
-            }
-            CellInterface::Value val = cell->GetValue();
+        std::lock_guard lock(mutex_);
+        entries_[std::move(key)] = compiled;
+        if (entries_.size() >= sweep_limit_) {
+            Sweep();
+        }
+        return compiled;
+    }
 
-            if (std::holds_alternative<double>(val)) {
-                result = std::get<double>(val);
-            }
+private:
+    static std::shared_ptr<const CompiledFormula> Compile(const std::string& expression, Position origin) {
+        FormulaAST ast = ParseFormulaAST(expression);
+        ast.ShiftReferences({-origin.row, -origin.col});
+        return std::make_shared<const CompiledFormula>(std::move(ast));
+    }
 
-            if (std::holds_alternative<FormulaError>(val)) {
-                throw std::get<FormulaError>(val);
+    void Sweep() {
+        for (auto it = entries_.begin(); it != entries_.end();) {
+            if (it->second.expired()) {
+                it = entries_.erase(it);
+            } else {
+                ++it;
             }
+        }
+        sweep_limit_ = std::max<size_t>(1024, entries_.size() * 2);
+    }
 
-            if (std::holds_alternative<std::string>(val)) {
-                if(std::get<std::string>(val).empty()) {
-                    return 0.0;
-                }
-                try {
-                    result = std::stod(std::get<std::string>(val));
-                } catch (std::invalid_argument& err) {
-                    throw FormulaError(FormulaError::Category::Value);
-                }
+    std::mutex mutex_;
+    std::unordered_map<std::string, std::weak_ptr<const CompiledFormula>> entries_;
+    size_t sweep_limit_ = 1024;
+};
+
+FormulaCache& GetFormulaCache() {
+    static FormulaCache cache;
+    return cache;
+}
+
+class Formula : public FormulaInterface {
+public:
+    Formula(std::string expression, Position origin) try
+        : compiled_{GetFormulaCache().Get(expression, origin)}, origin_{origin} {
+    } catch(std::exception &) {
+        throw FormulaException("ParseFormula error");
+    }
+
+    Formula(std::shared_ptr<const CompiledFormula> compiled, Position origin)
+        : compiled_{std::move(compiled)}, origin_{origin} {
+    }
+
+    FormulaInterface::Value Evaluate(const SheetInterface& sheet) const override {
+        FormulaInterface::Value result;
+
+        auto Exec = [this, &sheet](const Position offset) {
+            const Position pos = Shift(offset);
+            if (!pos.IsValid()) {
+                throw FormulaError(FormulaError::Category::Ref);
             }
+            return sheet.GetCellNumber(pos);
+        };
 
-            return result;
+        auto Gather = [this, &sheet](const CellRange& range, const RangeValuesConsumer& consumer) {
+            const CellRange shifted = Shift(range);
+            sheet.GatherRangeValues(shifted.first, shifted.last, consumer);
         };
 
         try {
-            result = ast_.Execute(Exec);
+            result = compiled_->ast.Execute(Exec, Gather);
         } catch (FormulaError& err) {
             result = err;
         }
@@ -74,20 +141,84 @@ public:
     }
     std::string GetExpression() const override {
         std::stringstream ss;
-        ast_.PrintFormula(ss);
+        compiled_->ast.PrintFormula(ss, origin_);
         return ss.str();
     }
 
-    std::vector<Position> GetReferencedCells() const {
-        return referenced_cells_;
+    std::vector<Position> GetReferencedCells() const override {
+        std::vector<Position> referenced_cells = GetCellReferences();
+        if (compiled_->range_offsets.empty()) {
+            return referenced_cells;
+        }
+
+        for (const CellRange& range : GetRangeReferences()) {
+            for (int row = range.first.row; row <= range.last.row; ++row) {
+                for (int col = range.first.col; col <= range.last.col; ++col) {
+                    referenced_cells.push_back({row, col});
+                }
+            }
+        }
+        std::sort(referenced_cells.begin(), referenced_cells.end());
+        auto uniq_end = std::unique(referenced_cells.begin(), referenced_cells.end());
+        referenced_cells.erase(uniq_end, referenced_cells.end());
+        return referenced_cells;
+    }
+
+    std::vector<Position> GetCellReferences() const override {
+        std::vector<Position> referenced_cells;
+        referenced_cells.reserve(compiled_->referenced_offsets.size());
+        for (const Position offset : compiled_->referenced_offsets) {
+            referenced_cells.push_back(Shift(offset));
+        }
+        return referenced_cells;
+    }
+
+    std::vector<CellRange> GetRangeReferences() const override {
+        std::vector<CellRange> ranges;
+        ranges.reserve(compiled_->range_offsets.size());
+        for (const CellRange& range : compiled_->range_offsets) {
+            ranges.push_back(Shift(range));
+        }
+        return ranges;
+    }
+
+    void Serialize(std::string& out) const override {
+        compiled_->ast.Serialize(out);
+    }
+
+    std::unique_ptr<FormulaInterface> CopyTo(Position origin) const override {
+        return std::make_unique<Formula>(compiled_, origin);
     }
 
 private:
-    FormulaAST ast_;
-    std::vector<Position> referenced_cells_;
+    Position Shift(Position offset) const {
+        return {origin_.row + offset.row, origin_.col + offset.col};
+    }
+
+    CellRange Shift(const CellRange& range) const {
+        return {Shift(range.first), Shift(range.last)};
+    }
+
+    std::shared_ptr<const CompiledFormula> compiled_;
+    Position origin_;
 };
 }  // namespace
 
 std::unique_ptr<FormulaInterface> ParseFormula(std::string expression) {
-    return std::make_unique<Formula>(std::move(expression));
+    return ParseFormula(std::move(expression), {0, 0});
+}
+
+std::unique_ptr<FormulaInterface> ParseFormula(std::string expression, Position origin) {
+    return std::make_unique<Formula>(std::move(expression), origin);
+}
+
+std::unique_ptr<FormulaInterface> LoadFormula(std::string_view data, Position origin) {
+    std::shared_ptr<const CompiledFormula> compiled;
+    try {
+        // двоичная форма уже относительная
+        compiled = std::make_shared<const CompiledFormula>(DeserializeFormulaAST(data));
+    } catch (const std::exception&) {
+        throw FormulaException("LoadFormula error");
+    }
+    return std::make_unique<Formula>(std::move(compiled), origin);
 }
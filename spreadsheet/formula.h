@@ -3,12 +3,18 @@
 #include "common.h"
 
 #include <memory>
+#include <string>
+#include <string_view>
 #include <vector>
 
 // Формула, позволяющая вычислять и обновлять арифметическое выражение.
 // Поддерживаемые возможности:
 // * Простые бинарные операции и числа, скобки: 1+2*3, 2.5*(2+3.5/7)
 // * Значения ячеек в качестве переменных: A1+B2*C3
+// * Агрегатные функции SUM, AVERAGE, MIN, MAX, COUNT от чисел, выражений и
+//   диапазонов: SUM(A1:B3,C5*2). В диапазонах пустые ячейки и текст, не
+//   являющийся числом, пропускаются. MIN и MAX без значений равны нулю,
+//   AVERAGE без значений даёт ошибку #ARITHM!
 // Ячейки, указанные в формуле, могут быть как формулами, так и текстом. Если это
 // текст, но он представляет число, тогда его нужно трактовать как число. Пустая
 // ячейка или ячейка с пустым текстом трактуется как число ноль.
@@ -34,8 +40,31 @@ public:
     // формулы. Список отсортирован по возрастанию и не содержит повторяющихся
     // ячеек.
     virtual std::vector<Position> GetReferencedCells() const = 0;
+
+    // То же без раскрытия диапазонов: ячейки, на которые формула ссылается
+    // по отдельности (отсортированы, без повторов), и диапазоны (без повторов).
+    virtual std::vector<Position> GetCellReferences() const = 0;
+    virtual std::vector<CellRange> GetRangeReferences() const = 0;
+
+    // Дописывает в out двоичную форму формулы, не зависящую от ячейки, в
+    // которой она записана. По ней LoadFormula() восстанавливает формулу
+    // без разбора текста.
+    virtual void Serialize(std::string& out) const = 0;
+    // Та же формула, записанная в ячейке origin: ссылки сдвинуты на разницу
+    // позиций, скомпилированная программа общая с исходной формулой
+    virtual std::unique_ptr<FormulaInterface> CopyTo(Position origin) const = 0;
 };
 
 // Парсит переданное выражение и возвращает объект формулы.
 // Бросает FormulaException в случае, если формула синтаксически некорректна.
 std::unique_ptr<FormulaInterface> ParseFormula(std::string expression);
+
+// То же, для формулы, записанной в ячейке origin. Формулы, совпадающие с
+// точностью до сдвига всех ссылок (например, "A1*B1" в C1 и "A2*B2" в C2),
+// разбираются один раз и используют общую скомпилированную программу.
+std::unique_ptr<FormulaInterface> ParseFormula(std::string expression, Position origin);
+
+// Восстанавливает формулу ячейки origin из двоичной формы, записанной
+// FormulaInterface::Serialize(). Бросает FormulaException, если данные
+// повреждены.
+std::unique_ptr<FormulaInterface> LoadFormula(std::string_view data, Position origin);
@@ -0,0 +1,159 @@
+#include "journal.h"
+
+#include "binary_io.h"
+#include "sheet.h"
+
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+namespace {
+// Группа: заголовок GroupHeader, затем записи размером size байт, каждая -
+// позиция и текст, записанный WriteBinaryString()
+struct GroupHeader {
+    std::uint32_t magic;
+    std::uint32_t size;
+    std::uint32_t record_count;
+    std::uint32_t flags;
+    std::uint32_t checksum;
+};
+
+constexpr std::uint32_t GROUP_MAGIC = 0x4C4A5353;  // "SSJL"
+// операция продолжается в следующей группе
+constexpr std::uint32_t GROUP_CONTINUED = 1;
+// наименьшая запись - позиция и длина пустого текста
+constexpr size_t MIN_RECORD_SIZE = sizeof(Position) + sizeof(std::uint32_t);
+// записи применяются пакетами примерно такого числа
+constexpr size_t REPLAY_BATCH_SIZE = 1 << 16;
+
+// FNV-1a
+std::uint32_t Checksum(std::string_view data) {
+    std::uint32_t hash = 2166136261u;
+    for(char c : data) {
+        hash = (hash ^ static_cast<unsigned char>(c)) * 16777619u;
+    }
+    return hash;
+}
+}  // namespace
+
+EditJournal::EditJournal(std::ostream& output, size_t group_size)
+    : output_{output}, group_size_{group_size} {
+}
+
+EditJournal::~EditJournal() {
+    try {
+        Commit();
+    } catch(...) {
+        // ошибка потока видна по его состоянию
+    }
+}
+
+void EditJournal::Record(Position pos, std::string_view text) {
+    const size_t record_size = MIN_RECORD_SIZE + text.size();
+    if(record_size > MAX_GROUP_SIZE) {
+        throw std::length_error("EditJournal::Record: text is too long");
+    }
+    if(pending_.size() + record_size > MAX_GROUP_SIZE) {
+        // завершённые операции пишутся своей группой, начало текущей -
+        // группой, помеченной продолжением
+        const std::string_view pending = pending_;
+        WriteGroup(pending.substr(0, complete_size_), complete_count_, 0);
+        WriteGroup(pending.substr(complete_size_), pending_count_ - complete_count_, GROUP_CONTINUED);
+        output_.flush();
+        ClearPending();
+    }
+    WriteBinary(pending_, pos);
+    WriteBinaryString(pending_, text);
+    ++pending_count_;
+}
+
+void EditJournal::CommitIfFull() {
+    if(pending_.size() >= group_size_) {
+        Commit();
+        return;
+    }
+    complete_size_ = pending_.size();
+    complete_count_ = pending_count_;
+}
+
+void EditJournal::Commit() {
+    if(pending_count_ == 0) {
+        return;
+    }
+    WriteGroup(pending_, pending_count_, 0);
+    output_.flush();
+    ClearPending();
+}
+
+void EditJournal::WriteGroup(std::string_view records, size_t count, std::uint32_t flags) {
+    if(count == 0) {
+        return;
+    }
+    std::string group;
+    group.reserve(sizeof(GroupHeader) + records.size());
+    WriteBinary(group, GroupHeader{GROUP_MAGIC, static_cast<std::uint32_t>(records.size()),
+                                   static_cast<std::uint32_t>(count), flags, Checksum(records)});
+    group += records;
+    output_.write(group.data(), static_cast<std::streamsize>(group.size()));
+}
+
+void EditJournal::ClearPending() {
+    pending_.clear();
+    pending_count_ = 0;
+    complete_size_ = 0;
+    complete_count_ = 0;
+}
+
+size_t EditJournal::GetPendingCount() const {
+    return pending_count_;
+}
+
+size_t EditJournal::Replay(std::istream& input, Sheet& sheet) {
+    if(sheet.GetJournal() != nullptr) {
+        throw std::logic_error("EditJournal::Replay: sheet has a journal");
+    }
+
+    size_t applied = 0;
+    std::vector<std::pair<Position, std::string>> batch;
+    // записи операции до её последней группы
+    size_t operation_start = 0;
+    std::string records;
+    GroupHeader header;
+    while(input.read(reinterpret_cast<char*>(&header), sizeof(header))) {
+        // испорченный заголовок не должен приводить к большому выделению
+        // памяти до проверки контрольной суммы
+        if(header.magic != GROUP_MAGIC || header.size > MAX_GROUP_SIZE || header.record_count == 0 ||
+            header.record_count > header.size / MIN_RECORD_SIZE || (header.flags & ~GROUP_CONTINUED) != 0) {
+            break;
+        }
+        records.resize(header.size);
+        if(!input.read(records.data(), header.size) || Checksum(records) != header.checksum) {
+            break;
+        }
+
+        BinaryReader reader(records);
+        for(std::uint32_t i = 0; i < header.record_count; ++i) {
+            const auto pos = reader.Read<Position>();
+            batch.emplace_back(pos, std::string(reader.ReadString()));
+        }
+        if(header.flags & GROUP_CONTINUED) {
+            continue;
+        }
+        operation_start = batch.size();
+        // порядок записей сохраняется, последняя запись ячейки в пакете
+        // действует так же, как при последовательном применении. Пакет
+        // применяется только на границе операции: середина операции может
+        // быть состоянием, в котором таблица не бывала, например с циклом
+        if(batch.size() >= REPLAY_BATCH_SIZE) {
+            applied += batch.size();
+            sheet.SetCells(std::move(batch));
+            batch.clear();
+            operation_start = 0;
+        }
+    }
+    // незавершённая операция отбрасывается
+    batch.erase(batch.begin() + operation_start, batch.end());
+    applied += batch.size();
+    sheet.SetCells(std::move(batch));
+    return applied;
+}
@@ -0,0 +1,70 @@
+#pragma once
+
+#include "common.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <istream>
+#include <ostream>
+#include <string>
+#include <string_view>
+
+class Sheet;
+
+// Журнал изменений таблицы, подключаемый через Sheet::SetJournal(). Каждое
+// изменение ячейки записывается двоичной записью: позиция и новый текст,
+// пустой текст означает очистку. Записи копятся в памяти и попадают в
+// поток группами: одна группа - одна запись в поток и один сброс буфера.
+// Группа снабжена длиной и контрольной суммой, поэтому недописанная при
+// сбое последняя группа при восстановлении отбрасывается целиком. Операция,
+// записи которой не поместились в одну группу, продолжается в следующих;
+// такие группы помечаются, и при восстановлении операция применяется только
+// целиком.
+class EditJournal {
+public:
+    static constexpr size_t DEFAULT_GROUP_SIZE = 64 * 1024;
+    // Предельный размер записей группы. Записи операции, не помещающиеся в
+    // одну группу, продолжаются в следующей; запись длиннее предела
+    // отвергается исключением std::length_error.
+    static constexpr size_t MAX_GROUP_SIZE = 64 * 1024 * 1024;
+
+    // Группа записывается, когда накопится group_size байт записей или при
+    // вызове Commit()
+    explicit EditJournal(std::ostream& output, size_t group_size = DEFAULT_GROUP_SIZE);
+    EditJournal(const EditJournal&) = delete;
+    EditJournal& operator=(const EditJournal&) = delete;
+    // Записывает накопленные записи
+    ~EditJournal();
+
+    void Record(Position pos, std::string_view text);
+    // Записывает группу, если накоплено не меньше group_size байт. Таблица
+    // вызывает его после каждой операции, поэтому группа, записанная здесь,
+    // завершает операцию.
+    void CommitIfFull();
+    // Записывает накопленные записи группой, завершающей операцию, и
+    // сбрасывает поток
+    void Commit();
+
+    // Число записей, ещё не записанных в поток
+    size_t GetPendingCount() const;
+
+    // Применяет журнал к таблице пакетами через Sheet::SetCells(). Пакет
+    // всегда заканчивается на границе операции. Чтение останавливается на
+    // первой повреждённой или недописанной группе, в том числе на заголовке
+    // с размером больше MAX_GROUP_SIZE; незавершённая к этому моменту
+    // операция отбрасывается.
+    // Таблица не должна вести журнал. Возвращает число применённых записей.
+    static size_t Replay(std::istream& input, Sheet& sheet);
+
+private:
+    void WriteGroup(std::string_view records, size_t count, std::uint32_t flags);
+    void ClearPending();
+
+    std::ostream& output_;
+    const size_t group_size_;
+    std::string pending_;
+    size_t pending_count_ = 0;
+    // начало записей операции, ещё не завершённой вызовом CommitIfFull()
+    size_t complete_size_ = 0;
+    size_t complete_count_ = 0;
+};
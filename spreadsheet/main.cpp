@@ -1,9 +1,22 @@
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <functional>
+#include <iomanip>
 #include <limits>
+#include <thread>
 
 #include <cassert>
+#include "binary_io.h"
 #include "common.h"
 #include "formula.h"
+#include "journal.h"
+#include "output_buffer.h"
+#include "recalc_trace.h"
+#include "FormulaAST.h"
+#include "sheet.h"
 #include "test_runner_p.h"
+#include "text_table_reader.h"
 
 inline std::ostream& operator<<(std::ostream& output, Position pos) {
     return output << "(" << pos.row << ", " << pos.col << ")";
@@ -133,6 +146,49 @@ void TestClearCell() {
     sheet->ClearCell("J10"_pos);
 }
 
+void TestSparseFarCell() {
+    auto sheet = CreateSheet();
+    const Position corner{Position::MAX_ROWS - 1, Position::MAX_COLS - 1};
+
+    sheet->SetCell(corner, "far");
+    sheet->SetCell("B2"_pos, "near");
+    ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{Position::MAX_ROWS, Position::MAX_COLS}));
+    ASSERT_EQUAL(sheet->GetCell(corner)->GetText(), "far");
+    ASSERT(sheet->GetCell({Position::MAX_ROWS - 2, Position::MAX_COLS - 1}) == nullptr);
+
+    sheet->ClearCell(corner);
+    ASSERT(sheet->GetCell(corner) == nullptr);
+    ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{2, 2}));
+}
+
+void TestPrintableSizeTracking() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "=J10");
+    ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{1, 1}));
+
+    for (int row = 0; row < 100; ++row) {
+        for (int col = 0; col < 10; ++col) {
+            sheet.SetCell({row, col}, "x");
+        }
+    }
+    sheet.SetCell("A1"_pos, "=J10");
+    ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{100, 10}));
+
+    sheet.ClearRange({50, 0}, {99, 9});
+    ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{50, 10}));
+    ASSERT(sheet.GetCell({75, 5}) == nullptr);
+
+    sheet.ClearRange({0, 5}, {49, 9});
+    ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{50, 5}));
+    // J10 очищена, но на неё ссылается A1
+    ASSERT(sheet.GetCell("J10"_pos) != nullptr);
+
+    sheet.SetCell("A1"_pos, "");
+    sheet.ClearRange({0, 0}, {Position::MAX_ROWS - 1, Position::MAX_COLS - 1});
+    ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{0, 0}));
+    ASSERT(sheet.GetCell("J10"_pos) == nullptr);
+}
+
 void TestFormulaArithmetic() {
     auto sheet = CreateSheet();
     auto evaluate = [&](std::string expr) {
@@ -148,6 +204,25 @@ void TestFormulaArithmetic() {
     ASSERT_EQUAL(evaluate("(12+13) * (14+(13-24/(1+1))*55-46)"), 575);
 }
 
+void TestFormulaDeepNesting() {
+    auto sheet = CreateSheet();
+    sheet->SetCell("A1"_pos, "1");
+
+    // каждое подвыражение должно вычисляться ровно один раз, иначе
+    // время вычисления растёт экспоненциально от глубины вложенности
+    std::string expr = "A1";
+    for (int i = 0; i < 100; ++i) {
+        expr = "(" + expr + "+A1)";
+    }
+    ASSERT_EQUAL(std::get<double>(ParseFormula(expr)->Evaluate(*sheet)), 101);
+
+    std::string negated = "A1";
+    for (int i = 0; i < 99; ++i) {
+        negated = "-(" + negated + ")";
+    }
+    ASSERT_EQUAL(std::get<double>(ParseFormula(negated)->Evaluate(*sheet)), -1);
+}
+
 void TestFormulaReferences() {
     auto sheet = CreateSheet();
     auto evaluate = [&](std::string expr) {
@@ -166,6 +241,77 @@ void TestFormulaReferences() {
     ASSERT_EQUAL(evaluate("A1+E4"), 1);  // Ячейка за пределами таблицы
 }
 
+void TestFastParserMatchesAntlr() {
+    auto describe = [](auto parse) {
+        try {
+            FormulaAST ast = parse();
+            std::ostringstream out;
+            ast.Print(out);
+            out << " | ";
+            ast.PrintCells(out);
+            return out.str();
+        } catch (const std::exception&) {
+            return std::string("<error>");
+        }
+    };
+    auto check = [&](const std::string& expr) {
+        std::string fast = describe([&] {
+            return ParseFormulaASTFast(expr);
+        });
+        std::string antlr = describe([&] {
+            std::istringstream in(expr);
+            return ParseFormulaAST(in);
+        });
+        AssertEqual(fast, antlr, "formula: " + expr);
+    };
+
+    for (const char* expr : {"1", " 42 ", "1.5", ".5", "1e3", "1E+3", "2.5e-2", "1.", "1e", "1e+",
+                             "A1", "ZZ99", "A0", "ABCD1", "a1", "A1B", "3X", "1+2*3", "(1+2)*3",
+                             "-1", "--1", "+-+1", "-A1*2", "-(1+2)", "1-2-3", "8/4/2", "1--2",
+                             "((1)", "(1))", "()", "", "  ", "1 2", "2+4-", "A1+", "*1", "1+*2",
+                             "1e400", "1\t+\n2\r", "A1:A2", "$A$1", "1,5", "SUM(A1:B2)", "SUM()",
+                             "AVERAGE(1, 2,A1)", "MIN(A1:A2,-3*2)", "MAX((1),B2:A1)", "COUNT(A1:A2:A3)",
+                             "SUM(A1:A2+1)", "SUM(1,)", "SUM(,1)", "SUM", "SUM A1", "FOO(1)", "sum(1)",
+                             "SUM(A1:B)", "SUM(A0:A1)", "SUM(1+2)*3", "-SUM(SUM(1),2)", "SUM((A1:A2))"}) {
+        check(expr);
+    }
+
+    // случайные выражения с небольшой долей синтаксических ошибок
+    unsigned seed = 12345;
+    auto next = [&seed](unsigned bound) {
+        seed = seed * 1103515245 + 12345;
+        return (seed >> 16) % bound;
+    };
+    std::function<std::string(int)> generate = [&](int depth) -> std::string {
+        static const char* atoms[] = {"0", "7", "12.25", ".5", "3e2", "4E-1", "A1", "B12", "AB3", "A0", "Q"};
+        static const char* ops[] = {"+", "-", "*", "/"};
+        static const char* spaces[] = {"", "", " ", "\t"};
+        static const char* functions[] = {"SUM", "AVERAGE", "MIN", "MAX", "COUNT"};
+        switch (depth <= 0 ? 0 : next(6)) {
+            case 0:
+                return atoms[next(std::size(atoms) - (next(20) == 0 ? 0 : 2))];
+            case 1:
+                return std::string(next(2) ? "-" : "+") + generate(depth - 1);
+            case 2:
+                return "(" + generate(depth - 1) + (next(30) == 0 ? "" : ")");
+            case 3: {
+                std::string call = std::string(functions[next(std::size(functions))]) + "(";
+                for (unsigned arg = 0, count = next(4); arg < count; ++arg) {
+                    call += arg > 0 ? "," : "";
+                    call += next(3) == 0 ? "A1:B3" : generate(depth - 1);
+                }
+                return call + ")";
+            }
+            default:
+                return generate(depth - 1) + spaces[next(4)] + ops[next(4)] + spaces[next(4)] +
+                       generate(depth - 1);
+        }
+    };
+    for (int i = 0; i < 2000; ++i) {
+        check(generate(static_cast<int>(next(6))));
+    }
+}
+
 void TestFormulaExpressionFormatting() {
     auto reformat = [](std::string expr) {
         return ParseFormula(std::move(expr))->GetExpression();
@@ -203,6 +349,19 @@ void TestErrorValue() {
     sheet->SetCell("E2"_pos, "3D");
     ASSERT_EQUAL(sheet->GetCell("E4"_pos)->GetValue(),
                     CellInterface::Value(FormulaError::Category::Value));
+
+    // числовой текст разбирается целиком
+    sheet->SetCell("E2"_pos, "'2.5e1");
+    ASSERT_EQUAL(sheet->GetCell("E4"_pos)->GetValue(), CellInterface::Value(25.0));
+    for (const char* text : {" 1", "1 ", "+1", "0x10", "inf", "nan", "1e999", "1,5"}) {
+        sheet->SetCell("E2"_pos, text);
+        ASSERT_EQUAL(sheet->GetCell("E4"_pos)->GetValue(),
+                     CellInterface::Value(FormulaError::Category::Value));
+    }
+    sheet->SetCell("E2"_pos, "'");
+    ASSERT_EQUAL(sheet->GetCell("E4"_pos)->GetValue(), CellInterface::Value(0.0));
+    sheet->SetCell("E2"_pos, "-0.5");
+    ASSERT_EQUAL(sheet->GetCell("E4"_pos)->GetValue(), CellInterface::Value(-0.5));
 }
 
 void TestErrorArithmetic() {
@@ -347,6 +506,1146 @@ void TestCellCircularReferences() {
     ASSERT(caught);
     ASSERT_EQUAL(sheet->GetCell("M6"_pos)->GetText(), "Ready");
 }
+
+void TestDiamondRecalculation() {
+    Sheet sheet;
+    constexpr int levels = 60;
+
+    // A(i) = B(i) + C(i), B(i) = A(i-1), C(i) = A(i-1): каждая ячейка
+    // достижима из A1 по 2^i путям
+    sheet.SetCell("A1"_pos, "1");
+    for (int row = 1; row < levels; ++row) {
+        std::string prev = Position{row - 1, 0}.ToString();
+        sheet.SetCell(Position{row, 1}, "=" + prev);
+        sheet.SetCell(Position{row, 2}, "=" + prev);
+        sheet.SetCell(Position{row, 0},
+                      "=" + Position{row, 1}.ToString() + "+" + Position{row, 2}.ToString());
+    }
+
+    const Position last{levels - 1, 0};
+    ASSERT_EQUAL(sheet.GetCell(last)->GetValue(), CellInterface::Value(std::ldexp(1.0, levels - 1)));
+
+    sheet.SetCell("A1"_pos, "3");
+    sheet.Recalculate();
+    ASSERT_EQUAL(sheet.GetCell(last)->GetValue(),
+                 CellInterface::Value(3 * std::ldexp(1.0, levels - 1)));
+    ASSERT_EQUAL(sheet.GetCell("B2"_pos)->GetValue(), CellInterface::Value(3.0));
+}
+
+void TestBatchEdit() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "1");
+
+    sheet.BeginBatch();
+    sheet.SetCell("B1"_pos, "=A1+C1");
+    sheet.SetCell("C1"_pos, "=A1*2");
+    sheet.SetCell("A1"_pos, "2");
+    // до завершения пакета таблица не меняется
+    ASSERT(sheet.GetCell("B1"_pos) == nullptr);
+    ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetText(), "1");
+    sheet.CommitBatch();
+
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(6.0));
+    ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{1, 3}));
+
+    // пакет с циклами отменяется целиком, в сообщении все ячейки циклов
+    try {
+        sheet.SetCells({{"A1"_pos, "=B1"}, {"D1"_pos, "=E1"}, {"E1"_pos, "=D1"}, {"F1"_pos, "=F1"},
+                        {"G1"_pos, "ok"}});
+        ASSERT(false);
+    } catch (const CircularDependencyException& err) {
+        ASSERT_EQUAL(std::string(err.what()), "Circular Dependency: A1 B1 C1 D1 E1 F1");
+    }
+    ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetText(), "2");
+    ASSERT(sheet.GetCell("G1"_pos) == nullptr);
+
+    sheet.SetCells({{"A1"_pos, "5"}, {"C1"_pos, ""}});
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(5.0));
+}
+
+void TestParallelRecalculation() {
+    constexpr int rows = 20;
+    constexpr int cols = 300;
+    auto fill = [](Sheet& sheet) {
+        for (int col = 0; col < cols; ++col) {
+            sheet.SetCell({0, col}, std::to_string(col % 7));
+        }
+        for (int row = 1; row < rows; ++row) {
+            for (int col = 0; col < cols; ++col) {
+                const Position left{row - 1, col};
+                const Position right{row - 1, (col + 1) % cols};
+                sheet.SetCell({row, col}, "=" + left.ToString() + "/2+" + right.ToString() + "/3");
+            }
+        }
+    };
+
+    Sheet serial;
+    Sheet parallel;
+    parallel.SetRecalculationThreads(4);
+    fill(serial);
+    fill(parallel);
+    serial.SetCell("A1"_pos, "100");
+    parallel.SetCell("A1"_pos, "100");
+    serial.Recalculate();
+    parallel.Recalculate();
+
+    for (int row = 0; row < rows; ++row) {
+        for (int col = 0; col < cols; ++col) {
+            ASSERT_EQUAL(parallel.GetCell({row, col})->GetValue(), serial.GetCell({row, col})->GetValue());
+        }
+    }
+}
+
+void TestRelativeFormulaCopies() {
+    auto sheet = CreateSheet();
+    for (int row = 0; row < 100; ++row) {
+        const std::string r = std::to_string(row + 1);
+        sheet->SetCell({row, 0}, std::to_string(row));
+        sheet->SetCell({row, 1}, "2");
+        // одинаковая относительная форма, разная запись
+        sheet->SetCell({row, 2}, row % 2 ? "=A" + r + "*B" + r : "= A" + r + " * B" + r);
+    }
+
+    ASSERT_EQUAL(sheet->GetCell("C50"_pos)->GetText(), "=A50*B50");
+    ASSERT_EQUAL(sheet->GetCell("C50"_pos)->GetValue(), CellInterface::Value(98.0));
+    ASSERT_EQUAL(sheet->GetCell("C1"_pos)->GetValue(), CellInterface::Value(0.0));
+    ASSERT_EQUAL(sheet->GetCell("C100"_pos)->GetReferencedCells(),
+                 (std::vector{"A100"_pos, "B100"_pos}));
+
+    // общая программа печатается относительно ячейки каждой копии
+    auto top = ParseFormula("A1+1", "A2"_pos);
+    auto shifted = ParseFormula("A2+1", "A3"_pos);
+    ASSERT_EQUAL(top->GetExpression(), "A1+1");
+    ASSERT_EQUAL(shifted->GetExpression(), "A2+1");
+    ASSERT_EQUAL(ParseFormula("B1/2", "A1"_pos)->GetExpression(), "B1/2");
+}
+
+void TestRangeAggregates() {
+    auto sheet = CreateSheet();
+    // больше одной порции значений и хвост, не кратный числу дорожек
+    for (int row = 0; row < 1001; ++row) {
+        sheet->SetCell({row, 0}, std::to_string(row + 1));
+    }
+    sheet->SetCell("B1"_pos, "text");
+    sheet->SetCell("B2"_pos, "'5");
+    sheet->SetCell("B4"_pos, "-2");
+
+    auto value = [&sheet](std::string_view pos) {
+        return sheet->GetCell(Position::FromString(pos))->GetValue();
+    };
+
+    sheet->SetCell("C1"_pos, "=SUM(A1:A1001)");
+    ASSERT_EQUAL(value("C1"), CellInterface::Value(501501.0));
+    sheet->SetCell("C2"_pos, "=AVERAGE(A1001:A1)");
+    ASSERT_EQUAL(value("C2"), CellInterface::Value(501.0));
+    ASSERT_EQUAL(sheet->GetCell("C2"_pos)->GetText(), "=AVERAGE(A1:A1001)");
+    sheet->SetCell("C3"_pos, "=MIN(A1:B10) + MAX(A1:A1001, 2000)");
+    ASSERT_EQUAL(value("C3"), CellInterface::Value(1998.0));
+    // текст и пустые ячейки диапазона пропускаются
+    sheet->SetCell("C4"_pos, "=COUNT(B1:B10)");
+    ASSERT_EQUAL(value("C4"), CellInterface::Value(2.0));
+    sheet->SetCell("C5"_pos, "=SUM(B1:B3, 1, (2))*2");
+    ASSERT_EQUAL(value("C5"), CellInterface::Value(16.0));
+    ASSERT_EQUAL(sheet->GetCell("C5"_pos)->GetText(), "=SUM(B1:B3,1,2)*2");
+
+    sheet->SetCell("D1"_pos, "=MAX(E1:E5)");
+    ASSERT_EQUAL(value("D1"), CellInterface::Value(0.0));
+    sheet->SetCell("D2"_pos, "=AVERAGE(E1:E5)");
+    ASSERT_EQUAL(value("D2"), CellInterface::Value(FormulaError::Category::Arithmetic));
+
+    // ошибки ячеек диапазона передаются в результат
+    sheet->SetCell("E3"_pos, "=1/0");
+    ASSERT_EQUAL(value("D1"), CellInterface::Value(FormulaError::Category::Arithmetic));
+    sheet->SetCell("E3"_pos, "7");
+    ASSERT_EQUAL(value("D1"), CellInterface::Value(7.0));
+
+    ASSERT_EQUAL(sheet->GetCell("D1"_pos)->GetReferencedCells(),
+                 (std::vector{"E1"_pos, "E2"_pos, "E3"_pos, "E4"_pos, "E5"_pos}));
+
+    try {
+        sheet->SetCell("E1"_pos, "=SUM(D1:D2)");
+        ASSERT(false);
+    } catch (const CircularDependencyException&) {
+    }
+
+    try {
+        sheet->SetCell("E1"_pos, "=FOO(D1:D2)");
+        ASSERT(false);
+    } catch (const FormulaException&) {
+    }
+}
+
+void TestRangeDependencyIndex() {
+    Sheet sheet;
+    sheet.SetRecalculationThreads(2);
+    sheet.SetCell("B1"_pos, "=SUM(A1:A16384)");
+    sheet.SetCell("C1"_pos, "=B1*2");
+    // ячейки диапазона не создаются
+    ASSERT(sheet.GetCell("A5"_pos) == nullptr);
+    ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{1, 3}));
+    ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(0.0));
+
+    sheet.SetCell("A100"_pos, "5");
+    ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(10.0));
+    sheet.SetCell("A200"_pos, "=A100+1");
+    sheet.Recalculate();
+    ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(22.0));
+    sheet.ClearCell("A100"_pos);
+    ASSERT(sheet.GetCell("A100"_pos) != nullptr);
+    ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(2.0));
+    sheet.ClearCell("A200"_pos);
+    ASSERT(sheet.GetCell("A200"_pos) == nullptr);
+    ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(0.0));
+
+    // после замены формулы старый диапазон больше не влияет на ячейку
+    sheet.SetCell("B1"_pos, "=MAX(D1:E2)");
+    sheet.SetCell("A1"_pos, "7");
+    sheet.SetCell("E2"_pos, "3");
+    ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(6.0));
+
+    try {
+        sheet.SetCell("A7"_pos, "=C1");
+        sheet.SetCell("D2"_pos, "=A7");
+        ASSERT(false);
+    } catch (const CircularDependencyException&) {
+    }
+    try {
+        sheet.SetCells({{"F1"_pos, "=B1"}, {"D1"_pos, "=F1"}});
+        ASSERT(false);
+    } catch (const CircularDependencyException& err) {
+        ASSERT_EQUAL(std::string(err.what()), "Circular Dependency: B1 D1 F1");
+    }
+    ASSERT(sheet.GetCell("D1"_pos) == nullptr);
+
+    // много узких диапазонов в одних строках: изменение ячейки затрагивает
+    // только формулы её столбца
+    Sheet wide;
+    constexpr int columns = 300;
+    for (int col = 0; col < columns; ++col) {
+        const std::string column = Position{0, col}.ToString();
+        const std::string range = column.substr(0, column.size() - 1);
+        wide.SetCell({1000, col}, "=SUM(" + range + "1:" + range + "100)+SUM(" + range + "50:" + range + "60)");
+        wide.SetCell({col % 100, col}, "1");
+    }
+    auto check_values = [&](double extra_at_120) {
+        for (int col = 0; col < columns; ++col) {
+            // ячейка строки col % 100 + 1 попадает и во второй диапазон при 50..60
+            const int row = col % 100 + 1;
+            double expected = row >= 50 && row <= 60 ? 2.0 : 1.0;
+            if (col == 120) {
+                expected += extra_at_120;
+            }
+            ASSERT_EQUAL(wide.GetCell({1000, col})->GetValue(), CellInterface::Value(expected));
+        }
+    };
+    check_values(0);
+    // ячейка строки 56 столбца 120 лежит в обоих диапазонах его формулы
+    wide.SetCell({55, 120}, "2");
+    check_values(4);
+    // после замены формулы оба её диапазона удалены из индекса
+    wide.SetCell({1000, 120}, "=1");
+    wide.SetCell({55, 120}, "5");
+    ASSERT_EQUAL(wide.GetCell({1000, 120})->GetValue(), CellInterface::Value(1.0));
+    ASSERT_EQUAL(wide.GetCell({1000, 121})->GetValue(), CellInterface::Value(1.0));
+}
+
+void TestColumnarNumericValues() {
+    {
+        Sheet sheet;
+        CellStorage storage;
+        for (int row = 60; row < 70; ++row) {
+            storage.Create(sheet, {row, 3});
+            storage.SetNumericValue({row, 3}, {NumericValue::Tag::Number, double(row)});
+        }
+        storage.SetNumericValue({65, 3}, {NumericValue::Tag::Text});
+
+        // отрезки столбца не пересекают границу плитки, значения в них идут подряд
+        std::vector<std::pair<Position, std::vector<double>>> segments;
+        std::vector<NumericValue::Tag> tags;
+        storage.ForEachColumnSegment({62, 2}, {100, 3}, [&](Position top, const double* numbers,
+                                                            const NumericValue::Tag* segment_tags, int count) {
+            if (top.col == 3) {
+                segments.push_back({top, std::vector<double>(numbers, numbers + count)});
+                tags.insert(tags.end(), segment_tags, segment_tags + count);
+            }
+        });
+        ASSERT(tags[65 - 62] == NumericValue::Tag::Text);
+        ASSERT(tags[66 - 62] == NumericValue::Tag::Number);
+        ASSERT(tags[70 - 62] == NumericValue::Tag::Empty);
+        ASSERT_EQUAL(segments.size(), 2u);
+        ASSERT(segments[0].first == Position({62, 3}));
+        ASSERT_EQUAL(segments[0].second, (std::vector<double>{62, 63}));
+        ASSERT(segments[1].first == Position({64, 3}));
+        ASSERT_EQUAL(segments[1].second.size(), 37u);
+        ASSERT_EQUAL(segments[1].second[5], 69.0);
+
+        storage.Erase({64, 3});
+        ASSERT(storage.GetNumericValue({64, 3}).tag == NumericValue::Tag::Empty);
+        ASSERT_EQUAL(storage.GetNumericValue({66, 3}).number, 66.0);
+    }
+
+    // значения для формул следуют за содержимым и пересчётом ячеек
+    Sheet sheet;
+    for (int row = 0; row < 200; ++row) {
+        sheet.SetCell({row, 0}, std::to_string(row));
+    }
+    sheet.SetCell("A10"_pos, "text");
+    sheet.SetCell("A20"_pos, "=A1+100");
+    sheet.SetCell("B1"_pos, "=SUM(A1:A200)");
+    sheet.SetCell("B2"_pos, "=A20*2");
+    const double sum = 199 * 200 / 2 - 9 - 19 + 100;
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(sum));
+    ASSERT_EQUAL(sheet.GetCell("B2"_pos)->GetValue(), CellInterface::Value(200.0));
+
+    sheet.SetCell("A1"_pos, "1");
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(sum + 2));
+    ASSERT_EQUAL(sheet.GetCell("B2"_pos)->GetValue(), CellInterface::Value(202.0));
+    sheet.SetCell("A1"_pos, "=1/0");
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(),
+                 CellInterface::Value(FormulaError::Category::Arithmetic));
+    ASSERT_EQUAL(sheet.GetCell("B2"_pos)->GetValue(),
+                 CellInterface::Value(FormulaError::Category::Arithmetic));
+    sheet.ClearCell("A1"_pos);
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(sum));
+}
+
+void TestIncrementalCycleDetection() {
+    // цепочка длиннее, чем позволил бы рекурсивный обход
+    {
+        Sheet sheet;
+        constexpr int length = 200000;
+        auto at = [](int i) {
+            return Position{i % Position::MAX_ROWS, i / Position::MAX_ROWS};
+        };
+        sheet.SetCell(at(0), "1");
+        for (int i = 1; i < length; ++i) {
+            sheet.SetCell(at(i), "=" + at(i - 1).ToString() + "+1");
+        }
+        try {
+            sheet.SetCell(at(0), "=" + at(length - 1).ToString());
+            ASSERT(false);
+        } catch (const CircularDependencyException&) {
+        }
+        ASSERT_EQUAL(sheet.GetCell(at(length - 1))->GetValue(), CellInterface::Value(double(length)));
+    }
+
+    // случайные правки: исключение бросается ровно тогда, когда ячейка
+    // достижима из своих аргументов, и порядок остаётся топологическим
+    Sheet sheet;
+    constexpr int size = 6;
+    unsigned seed = 777;
+    auto next = [&seed](unsigned bound) {
+        seed = seed * 1103515245 + 12345;
+        return static_cast<int>((seed >> 16) % bound);
+    };
+    auto reachable = [&sheet](Position from, Position target) {
+        std::vector<Position> stack{from};
+        std::set<Position> visited;
+        while (!stack.empty()) {
+            const Position pos = stack.back();
+            stack.pop_back();
+            if (pos == target) {
+                return true;
+            }
+            const CellInterface* cell = sheet.GetCell(pos);
+            if (cell != nullptr && visited.insert(pos).second) {
+                for (Position arg : cell->GetReferencedCells()) {
+                    stack.push_back(arg);
+                }
+            }
+        }
+        return false;
+    };
+
+    for (int step = 0; step < 3000; ++step) {
+        const Position pos{next(size), next(size)};
+        std::string text = "=1";
+        bool cyclic = false;
+        if (next(5) == 0) {
+            const Position first{next(size), next(size)};
+            const Position last{first.row + next(2), first.col + next(3)};
+            text += "+SUM(" + first.ToString() + ":" + last.ToString() + ")";
+            for (int row = first.row; row <= last.row; ++row) {
+                for (int col = first.col; col <= last.col; ++col) {
+                    cyclic = cyclic || reachable({row, col}, pos);
+                }
+            }
+        }
+        for (int i = 0, count = next(3); i < count; ++i) {
+            const Position arg{next(size), next(size)};
+            text += "+" + arg.ToString();
+            cyclic = cyclic || reachable(arg, pos);
+        }
+
+        try {
+            sheet.SetCell(pos, text);
+            ASSERT(!cyclic);
+        } catch (const CircularDependencyException&) {
+            ASSERT(cyclic);
+        }
+
+        for (int row = 0; row < size + 2; ++row) {
+            for (int col = 0; col < size + 3; ++col) {
+                const auto* cell = dynamic_cast<const Cell*>(sheet.GetCell({row, col}));
+                if (cell == nullptr) {
+                    continue;
+                }
+                for (Position arg : cell->GetReferencedCells()) {
+                    const auto* arg_cell = dynamic_cast<const Cell*>(sheet.GetCell(arg));
+                    ASSERT(arg_cell == nullptr || arg_cell->GetOrder() < cell->GetOrder());
+                }
+            }
+        }
+    }
+}
+
+void TestArenaAllocation() {
+    {
+        Arena arena;
+        ASSERT_EQUAL(arena.GetCapacity(), 0u);
+        auto* byte = arena.Create<char>('x');
+        auto* number = arena.Create<double>(1.5);
+        ASSERT_EQUAL(reinterpret_cast<std::uintptr_t>(number) % alignof(double), 0u);
+        ASSERT_EQUAL(*byte, 'x');
+        ASSERT_EQUAL(*number, 1.5);
+
+        // объекты не переезжают при росте арены и её перемещении
+        std::vector<const int*> values;
+        for (int i = 0; i < 100000; ++i) {
+            values.push_back(arena.Create<int>(i));
+        }
+        const std::vector<int> source{1, 2, 3};
+        const int* copy = arena.CopyArray(source.data(), source.size());
+        ASSERT(arena.CopyArray(source.data(), 0) == nullptr);
+
+        Arena moved = std::move(arena);
+        ASSERT(moved.GetCapacity() >= 100000 * sizeof(int));
+        for (int i = 0; i < 100000; ++i) {
+            ASSERT_EQUAL(*values[i], i);
+        }
+        ASSERT_EQUAL(std::vector<int>(copy, copy + 3), source);
+    }
+
+    // ссылки дерева сдвигаются на месте, дерево печатается как прежде
+    FormulaAST ast = ParseFormulaASTFast("SUM(B2:C3, -D4) + B2 * (A1 - 1)");
+    ASSERT_EQUAL(ast.GetCells(), (std::vector{"A1"_pos, "B2"_pos, "D4"_pos}));
+    ast.ShiftReferences({1, 2});
+    ASSERT_EQUAL(ast.GetCells(), (std::vector{"C2"_pos, "D3"_pos, "F5"_pos}));
+    ASSERT(ast.GetRanges()[0].first == "D3"_pos && ast.GetRanges()[0].last == "E4"_pos);
+    std::ostringstream out;
+    ast.PrintFormula(out);
+    ASSERT_EQUAL(out.str(), "SUM(D3:E4,-F5)+D3*(C2-1)");
+
+    // копии формулы разделяют одно дерево
+    auto sheet = CreateSheet();
+    for (int row = 0; row < 50; ++row) {
+        sheet->SetCell({row, 1}, "=SUM(A" + std::to_string(row + 1) + ":A50)+1");
+    }
+    sheet->SetCell("A50"_pos, "2");
+    ASSERT_EQUAL(sheet->GetCell("B1"_pos)->GetValue(), CellInterface::Value(3.0));
+    ASSERT_EQUAL(sheet->GetCell("B40"_pos)->GetText(), "=SUM(A40:A50)+1");
+}
+
+void TestPooledCells() {
+    {
+        ObjectPool<std::string, 4> pool;
+        std::vector<std::string*> strings;
+        for (int i = 0; i < 10; ++i) {
+            strings.push_back(pool.Create(std::to_string(i)));
+        }
+        ASSERT_EQUAL(pool.GetSize(), 10u);
+        ASSERT_EQUAL(pool.GetCapacity(), 12u);
+        ASSERT_EQUAL(*strings[7], "7");
+        std::string* freed = strings[3];
+        pool.Destroy(freed);
+        // освободившееся место занимает следующий объект
+        ASSERT(pool.Create("new") == freed);
+        for (std::string* str : strings) {
+            pool.Destroy(str);
+        }
+        ASSERT_EQUAL(pool.GetSize(), 0u);
+    }
+
+    // ячейка меняет тип содержимого на месте
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "text");
+    Cell* cell = sheet.GetCellPtr("A1"_pos);
+    sheet.SetCell("A1"_pos, "=B1+1");
+    ASSERT(sheet.GetCellPtr("A1"_pos) == cell);
+    ASSERT_EQUAL(cell->GetValue(), CellInterface::Value(1.0));
+    ASSERT(!cell->IsEmpty());
+    sheet.SetCell("A1"_pos, "'=B1");
+    ASSERT_EQUAL(cell->GetValue(), CellInterface::Value("=B1"));
+    ASSERT(cell->GetReferencedCells().empty());
+    sheet.SetCell("A1"_pos, "");
+    ASSERT(cell->IsEmpty());
+    ASSERT(sheet.GetCellPtr("Z100"_pos) == nullptr);
+    ASSERT(sheet.GetCellPtr({-1, 0}) == nullptr);
+
+    // места удалённых ячеек переиспользуются
+    CellStorage storage;
+    for (int round = 0; round < 3; ++round) {
+        for (int row = 0; row < 1000; ++row) {
+            storage.Create(sheet, {row, round});
+        }
+        for (int row = 0; row < 1000; ++row) {
+            storage.Erase({row, round});
+        }
+    }
+    ASSERT_EQUAL(storage.GetCellCount(), 0u);
+    ASSERT(storage.GetCellCapacity() < 2000);
+}
+
+void TestPrintBuffered() {
+    // значения печатаются так же, как потоком с настройками по умолчанию
+    Sheet sheet;
+    std::ostringstream expected_values;
+    std::ostringstream expected_texts;
+    constexpr int rows = 2000;
+    constexpr int cols = 5;
+    for (int row = 0; row < rows; ++row) {
+        const std::string r = std::to_string(row + 1);
+        const std::vector<std::string> texts{
+            std::to_string(row), "'text" + r, "=A" + r + "/3", "=1/(A" + r + "-7)*1e+08",
+            row % 2 ? "=B" + r : "=Z1000"};
+        for (int col = 0; col < cols; ++col) {
+            sheet.SetCell({row, col}, texts[col]);
+            expected_texts << texts[col] << (col + 1 < cols ? '\t' : '\n');
+        }
+        expected_values << row << "\ttext" << r << '\t' << row / 3.0 << '\t';
+        if (row == 7) {
+            expected_values << "#ARITHM!";
+        } else {
+            expected_values << 1 / (row - 7.0) * 1e8;
+        }
+        expected_values << '\t' << (row % 2 ? "#VALUE!" : "0") << '\n';
+    }
+
+    std::ostringstream values;
+    sheet.PrintValues(values);
+    ASSERT(values.str() == expected_values.str());
+    std::ostringstream texts;
+    sheet.PrintTexts(texts);
+    ASSERT(texts.str() == expected_texts.str());
+
+    std::ostringstream errors;
+    errors << FormulaError(FormulaError::Category::Ref) << FormulaError(FormulaError::Category::Value);
+    ASSERT_EQUAL(errors.str(), "#REF!#VALUE!");
+
+    std::ostringstream small;
+    {
+        OutputBuffer buffer(small, 64);
+        for (int i = 0; i < 100; ++i) {
+            buffer.Write(-1.0 / 3);
+            buffer.Write(' ');
+        }
+        buffer.Write(std::string(200, 'x'));
+    }
+    ASSERT_EQUAL(small.str().size(), 100 * 10 + 200u);
+
+    // настройки чисел потока соблюдаются, как у operator<<
+    Sheet formatted;
+    formatted.SetCell("A1"_pos, "=1/3");
+    formatted.SetCell("B1"_pos, "=1e+300");
+    formatted.SetCell("C1"_pos, "=-2/7");
+    auto check_format = [&formatted](const std::function<void(std::ostream&)>& setup) {
+        std::ostringstream actual;
+        std::ostringstream expected;
+        setup(actual);
+        setup(expected);
+        formatted.PrintValues(actual);
+        expected << 1.0 / 3 << '\t' << 1e300 << '\t' << -2.0 / 7 << '\n';
+        ASSERT_EQUAL(actual.str(), expected.str());
+    };
+    check_format([](std::ostream& output) { output << std::setprecision(15); });
+    check_format([](std::ostream& output) { output << std::fixed << std::setprecision(3); });
+    check_format([](std::ostream& output) { output << std::scientific << std::setprecision(2); });
+    check_format([](std::ostream& output) { output << std::showpos << std::uppercase; });
+    check_format([](std::ostream& output) { output << std::hexfloat; });
+}
+
+void TestImportTexts() {
+    // текст, напечатанный PrintTexts, загружается обратно
+    Sheet source;
+    for (int row = 0; row < 3000; ++row) {
+        const std::string r = std::to_string(row + 1);
+        source.SetCell({row, 0}, std::to_string(row));
+        if (row % 3 == 0) {
+            source.SetCell({row, 2}, "=A" + r + "*2+SUM(A1:A" + r + ")");
+        }
+        if (row % 7 == 0) {
+            source.SetCell({row, 3}, "'=text " + r);
+        }
+    }
+    std::stringstream printed;
+    source.PrintTexts(printed);
+
+    for (size_t threads : {1, 4}) {
+        Sheet sheet;
+        sheet.SetRecalculationThreads(threads);
+        std::istringstream input(printed.str());
+        sheet.ImportTexts(input);
+        ASSERT_EQUAL(sheet.GetPrintableSize(), source.GetPrintableSize());
+        std::ostringstream texts;
+        sheet.PrintTexts(texts);
+        ASSERT(texts.str() == printed.str());
+        std::ostringstream values;
+        std::ostringstream expected_values;
+        sheet.PrintValues(values);
+        source.PrintValues(expected_values);
+        ASSERT(values.str() == expected_values.str());
+        // пустые ячейки отсутствуют
+        ASSERT(sheet.GetCell({1, 1}) == nullptr);
+    }
+
+    // кавычки CSV и строки, длиннее куска чтения
+    {
+        std::istringstream input("1,\"a,b\",\"say \"\"hi\"\"\"\r\n"
+                                 "\"two\nlines\",,=A1+1\n"
+                                 "\n"
+                                 "last");
+        TextTableReader reader(input, ',', 3);
+        std::vector<std::string_view> rows;
+        std::vector<std::vector<std::pair<int, std::string>>> cells;
+        while (reader.ReadChunk(rows)) {
+            for (std::string_view row : rows) {
+                cells.emplace_back();
+                reader.SplitRow(row, [&](int col, std::string text) {
+                    cells.back().emplace_back(col, std::move(text));
+                });
+            }
+        }
+        ASSERT_EQUAL(cells.size(), 4u);
+        ASSERT(cells[0] == (std::vector<std::pair<int, std::string>>{
+                               {0, "1"}, {1, "a,b"}, {2, "say \"hi\""}}));
+        ASSERT(cells[1] == (std::vector<std::pair<int, std::string>>{
+                               {0, "two\nlines"}, {2, "=A1+1"}}));
+        ASSERT(cells[2].empty());
+        ASSERT(cells[3] == (std::vector<std::pair<int, std::string>>{{0, "last"}}));
+    }
+
+    // при ошибке таблица не меняется
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "5");
+    std::istringstream bad_formula("1\t=A2+\n");
+    try {
+        sheet.ImportTexts(bad_formula);
+        ASSERT(false);
+    } catch (const FormulaException&) {
+    }
+    std::istringstream cycle("=B1,=A1\n");
+    try {
+        sheet.ImportTexts(cycle, ',');
+        ASSERT(false);
+    } catch (const CircularDependencyException&) {
+    }
+    ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{1, 1}));
+    ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetText(), "5");
+}
+
+void TestSnapshot() {
+    Sheet source;
+    for (int row = 0; row < 500; ++row) {
+        const std::string r = std::to_string(row + 1);
+        source.SetCell({row, 0}, std::to_string(row));
+        source.SetCell({row, 1}, "=A" + r + "*2+SUM(A1:A" + r + ")");
+        source.SetCell({row, 2}, "=-(B" + r + "+1)/(A" + r + "-3)");
+    }
+    source.SetCell("D1"_pos, "'=escaped");
+    source.SetCell("D2"_pos, "=D1+1");
+    source.SetCell("D3"_pos, "=ZZ1+AVERAGE(E1:E2)");
+    // в снимок попадают и вычисленные, и устаревшие значения
+    source.GetCell("B500"_pos)->GetValue();
+    source.SetCell("A1"_pos, "7");
+
+    std::stringstream snapshot;
+    source.SaveSnapshot(snapshot);
+
+    Sheet sheet;
+    sheet.LoadSnapshot(snapshot);
+    ASSERT_EQUAL(sheet.GetPrintableSize(), source.GetPrintableSize());
+    std::ostringstream texts, expected_texts, values, expected_values;
+    sheet.PrintTexts(texts);
+    source.PrintTexts(expected_texts);
+    ASSERT(texts.str() == expected_texts.str());
+    sheet.PrintValues(values);
+    source.PrintValues(expected_values);
+    ASSERT(values.str() == expected_values.str());
+
+    // связи восстановлены: изменение пересчитывает зависимые ячейки
+    sheet.SetCell("A2"_pos, "100");
+    source.SetCell("A2"_pos, "100");
+    ASSERT_EQUAL(sheet.GetCell("B500"_pos)->GetValue(), source.GetCell("B500"_pos)->GetValue());
+    try {
+        sheet.SetCell("A1"_pos, "=C2");
+        ASSERT(false);
+    } catch (const CircularDependencyException&) {
+    }
+
+    // повреждённый снимок не загружается, таблица остаётся пустой
+    std::string data;
+    {
+        std::stringstream out;
+        source.SaveSnapshot(out);
+        data = out.str();
+    }
+    for (size_t size : {size_t(0), size_t(3), data.size() / 2, data.size() - 1}) {
+        Sheet broken;
+        std::istringstream input(data.substr(0, size));
+        try {
+            broken.LoadSnapshot(input);
+            ASSERT(false);
+        } catch (const std::runtime_error&) {
+        }
+        ASSERT_EQUAL(broken.GetPrintableSize(), (Size{0, 0}));
+    }
+
+    // число формул или ячеек больше, чем помещается в данные, отвергается
+    // до выделения памяти
+    const std::string header = data.substr(0, 2 * sizeof(uint32_t));
+    std::string huge_formulas = header;
+    WriteBinary(huge_formulas, uint32_t{0xFFFFFFFFu});
+    std::string huge_cells = header;
+    WriteBinary(huge_cells, uint32_t{0});
+    WriteBinary(huge_cells, uint64_t{1} << 60);
+    for (const std::string& oversized : {huge_formulas, huge_cells}) {
+        Sheet broken;
+        std::istringstream input(oversized + std::string(64, '\0'));
+        bool rejected = false;
+        try {
+            broken.LoadSnapshot(input);
+        } catch (const std::runtime_error&) {
+            rejected = true;
+        }
+        ASSERT(rejected);
+        ASSERT_EQUAL(broken.GetPrintableSize(), (Size{0, 0}));
+    }
+
+    // формула, перенесённая в другую ячейку, ссылается за пределы листа
+    auto load_moved = [](const std::string& text, Position from, Position to) {
+        Sheet single;
+        single.SetCell(from, text);
+        std::stringstream out;
+        single.SaveSnapshot(out);
+        std::string moved = out.str();
+        const std::string from_bytes(reinterpret_cast<const char*>(&from), sizeof(from));
+        const size_t offset = moved.rfind(from_bytes);
+        ASSERT(offset != std::string::npos);
+        moved.replace(offset, sizeof(to), reinterpret_cast<const char*>(&to), sizeof(to));
+
+        Sheet broken;
+        std::istringstream input(moved);
+        bool rejected = false;
+        try {
+            broken.LoadSnapshot(input);
+        } catch (const std::runtime_error&) {
+            rejected = true;
+        }
+        ASSERT(rejected);
+        ASSERT_EQUAL(broken.GetPrintableSize(), (Size{0, 0}));
+        ASSERT(broken.GetCell("A1"_pos) == nullptr);
+    };
+    load_moved("=A1+1", "C3"_pos, "B1"_pos);
+    load_moved("=SUM(A1:B2)", "D4"_pos, "A2"_pos);
+    load_moved("=XFD6", "D6"_pos, "E6"_pos);
+}
+
+void TestEditJournal() {
+    std::stringstream log;
+    Sheet sheet;
+    {
+        EditJournal journal(log, 256);
+        sheet.SetJournal(&journal);
+        for (int row = 0; row < 100; ++row) {
+            sheet.SetCell({row, 0}, std::to_string(row));
+        }
+        sheet.SetCell("B1"_pos, "=SUM(A1:A100)");
+        sheet.SetCells({{"C1"_pos, "=B1*2"}, {"C2"_pos, "'text"}, {"A5"_pos, ""}});
+        sheet.ClearCell("A7"_pos);
+        sheet.ClearRange("A90"_pos, "A95"_pos);
+        try {
+            sheet.SetCell("A1"_pos, "=C1");
+            ASSERT(false);
+        } catch (const CircularDependencyException&) {
+        }
+        // группы пишутся по мере накопления
+        ASSERT(!log.str().empty());
+        ASSERT(journal.GetPendingCount() < 100);
+        journal.Commit();
+        ASSERT_EQUAL(journal.GetPendingCount(), 0u);
+        sheet.SetJournal(nullptr);
+    }
+
+    Sheet restored;
+    const std::string data = log.str();
+    {
+        std::istringstream input(data);
+        ASSERT_EQUAL(EditJournal::Replay(input, restored), 100u + 1 + 3 + 1 + 6);
+    }
+    std::ostringstream texts, expected_texts, values, expected_values;
+    restored.PrintTexts(texts);
+    sheet.PrintTexts(expected_texts);
+    ASSERT(texts.str() == expected_texts.str());
+    restored.PrintValues(values);
+    sheet.PrintValues(expected_values);
+    ASSERT(values.str() == expected_values.str());
+
+    // недописанная последняя группа отбрасывается
+    std::istringstream truncated(data.substr(0, data.size() - 3));
+    Sheet partial;
+    const size_t applied = EditJournal::Replay(truncated, partial);
+    ASSERT(applied > 0 && applied < 111);
+    ASSERT(partial.GetCell("A1"_pos) != nullptr);
+
+    // испорченный заголовок последней группы: огромный размер или число
+    // записей, не помещающееся в размер
+    const std::string magic = data.substr(0, sizeof(uint32_t));
+    for (auto [size, count] : {std::pair<uint32_t, uint32_t>{0xFFFFFFF0u, 1}, {16, 1000}, {16, 0}}) {
+        std::string corrupted = data + magic;
+        WriteBinary(corrupted, size);
+        WriteBinary(corrupted, count);
+        WriteBinary(corrupted, uint32_t{0});
+        WriteBinary(corrupted, uint32_t{0});
+        corrupted += std::string(16, 'x');
+        std::istringstream input(corrupted);
+        Sheet replayed;
+        ASSERT_EQUAL(EditJournal::Replay(input, replayed), 111u);
+        std::ostringstream replayed_texts;
+        replayed.PrintTexts(replayed_texts);
+        ASSERT(replayed_texts.str() == expected_texts.str());
+    }
+
+    // записи одной большой операции делятся на группы не больше предела
+    std::stringstream large_log;
+    {
+        EditJournal journal(large_log);
+        const std::string text(EditJournal::MAX_GROUP_SIZE / 3, 'y');
+        for (int row = 0; row < 4; ++row) {
+            journal.Record({row, 0}, text);
+        }
+        journal.Commit();
+        bool rejected = false;
+        try {
+            journal.Record({0, 0}, std::string(EditJournal::MAX_GROUP_SIZE, 'z'));
+        } catch (const std::length_error&) {
+            rejected = true;
+        }
+        ASSERT(rejected);
+        ASSERT_EQUAL(journal.GetPendingCount(), 0u);
+    }
+    Sheet large;
+    ASSERT_EQUAL(EditJournal::Replay(large_log, large), 4u);
+    ASSERT_EQUAL(large.GetCell({3, 0})->GetText().size(), EditJournal::MAX_GROUP_SIZE / 3);
+
+    // разделённая операция применяется целиком: после первой её группы
+    // B1 = A1 уже записана, а A1 = B1 ещё не заменена текстом
+    std::stringstream split_log;
+    Sheet split;
+    {
+        EditJournal journal(split_log);
+        split.SetJournal(&journal);
+        split.SetCell("A1"_pos, "=B1");
+        std::vector<std::pair<Position, std::string>> contents;
+        for (int i = 0; i < (1 << 16); ++i) {
+            contents.emplace_back(Position{i % 1024, 5 + i / 1024}, "1");
+        }
+        contents.emplace_back("B1"_pos, "=A1");
+        contents.emplace_back("D1"_pos, std::string(EditJournal::MAX_GROUP_SIZE - 1024 * 1024, 'd'));
+        contents.emplace_back("A1"_pos, std::string(10 * 1024 * 1024, 'a'));
+        split.SetCells(std::move(contents));
+        split.SetJournal(nullptr);
+    }
+    const std::string split_data = split_log.str();
+    {
+        std::istringstream input(split_data);
+        Sheet replayed;
+        ASSERT_EQUAL(EditJournal::Replay(input, replayed), 1u + (1 << 16) + 3);
+        ASSERT_EQUAL(replayed.GetCell("A1"_pos)->GetText().size(), size_t{10 * 1024 * 1024});
+        ASSERT_EQUAL(replayed.GetCell("B1"_pos)->GetText(), std::string("=A1"));
+    }
+    // операция, оборванная после первой группы, не применяется вовсе
+    {
+        std::istringstream input(split_data.substr(0, split_data.size() - 3));
+        Sheet replayed;
+        ASSERT_EQUAL(EditJournal::Replay(input, replayed), 1u);
+        ASSERT_EQUAL(replayed.GetCell("A1"_pos)->GetText(), std::string("=B1"));
+        ASSERT_EQUAL(replayed.GetPrintableSize(), (Size{1, 1}));
+    }
+}
+
+void TestSheetStats() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "1");
+    sheet.SetCell("A2"_pos, "=A1+1");
+    sheet.SetCell("A3"_pos, "=A2*2");
+    sheet.SetCell("A4"_pos, "=SUM(A1:A3)");
+    ASSERT_EQUAL(sheet.GetCell("A4"_pos)->GetValue(), CellInterface::Value(7.0));
+    ASSERT_EQUAL(sheet.GetCell("A3"_pos)->GetValue(), CellInterface::Value(4.0));
+    sheet.SetCell("A1"_pos, "2");
+    std::ostringstream out;
+    sheet.PrintValues(out);
+    sheet.SetCells({{"B1"_pos, "=A4"}, {"B2"_pos, "text"}});
+
+    const SheetStats stats = sheet.GetStats();
+#if SPREADSHEET_STATS
+    ASSERT_EQUAL(stats.formulas_parsed, 4u);
+    ASSERT_EQUAL(stats.parse.count, 4u);
+    // A4 пересчитывается вместе с A2 и A3, затем A3 уже вычислена; после
+    // изменения A1 печать читает три устаревшие формулы
+    ASSERT_EQUAL(stats.value_cache_misses, 4u);
+    ASSERT_EQUAL(stats.value_cache_hits, 1u);
+    ASSERT(stats.formulas_evaluated >= 6);
+    ASSERT_EQUAL(stats.cells_invalidated, 3u);
+    ASSERT_EQUAL(stats.print.count, 1u);
+    // три одиночные формулы, проверка пакета и размещение B1
+    ASSERT_EQUAL(stats.cycle_check.count, 5u);
+    ASSERT(stats.invalidate.count >= 5);
+    uint64_t bucketed = 0;
+    for (uint64_t bucket : stats.parse.buckets) {
+        bucketed += bucket;
+    }
+    ASSERT_EQUAL(bucketed, 4u);
+    ASSERT(stats.parse.GetQuantileNs(0.5) <= stats.parse.GetQuantileNs(1.0));
+    ASSERT(stats.parse.GetQuantileNs(1.0) > 0);
+#endif
+
+    sheet.ResetStats();
+    ASSERT_EQUAL(sheet.GetStats().formulas_parsed, 0u);
+    ASSERT_EQUAL(sheet.GetStats().print.count, 0u);
+    ASSERT_EQUAL(LatencyHistogram{}.GetQuantileNs(0.99), 0u);
+}
+
+void TestRecalcTrace() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "1");
+    sheet.SetCell("B1"_pos, "=A1+1");
+    sheet.SetCell("B2"_pos, "=B1*2");
+    sheet.SetCell("B3"_pos, "=B2+1");
+    sheet.SetCell("C1"_pos, "=SUM(A1:B3)+B3");
+    sheet.SetCell("D1"_pos, "=A1");
+    sheet.Recalculate();
+
+    RecalcTrace trace;
+    sheet.SetTrace(&trace);
+    sheet.SetCell("A1"_pos, "2");
+    sheet.Recalculate();
+    ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(25.0));
+
+    const std::vector<TraceSpan> spans = trace.GetSpans();
+    ASSERT_EQUAL(spans.size(), 5u);
+    for (const TraceSpan& span : spans) {
+        if (span.pos == "C1"_pos) {
+            ASSERT_EQUAL(span.depth, 3u);
+            // B3 и существующие ячейки диапазона A1, B1, B2, B3
+            ASSERT_EQUAL(span.cells_read, 5u);
+        } else if (span.pos == "D1"_pos || span.pos == "B1"_pos) {
+            ASSERT_EQUAL(span.depth, 0u);
+        }
+        ASSERT(span.duration_ns >= 0 && span.path_ns >= span.duration_ns);
+    }
+
+    const RecalcTrace::Report report = trace.BuildReport(2);
+    ASSERT_EQUAL(report.hottest.size(), 2u);
+    ASSERT(report.hottest[0].duration_ns >= report.hottest[1].duration_ns);
+    const std::vector<Position> expected_path{"B1"_pos, "B2"_pos, "B3"_pos, "C1"_pos};
+    ASSERT(report.critical_path == expected_path);
+
+    std::ostringstream json;
+    trace.WriteChromeTrace(json);
+    ASSERT(json.str().rfind("{\"traceEvents\":[", 0) == 0);
+    ASSERT(json.str().find("\"name\":\"C1\",\"cat\":\"recalc\",\"ph\":\"X\"") != std::string::npos);
+    std::ostringstream text;
+    trace.PrintReport(text, 3);
+    ASSERT(text.str().find("B1 -> B2 -> B3 -> C1") != std::string::npos);
+
+    // при параллельном пересчёте цепочка та же
+    trace.Clear();
+    sheet.SetRecalculationThreads(4);
+    sheet.SetCell("A1"_pos, "3");
+    sheet.Recalculate();
+    ASSERT_EQUAL(trace.GetSpans().size(), 5u);
+    ASSERT(trace.BuildReport(1).critical_path == expected_path);
+    ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(33.0));
+
+    // в ручном режиме новая формула по устаревшим аргументам тоже
+    // попадает в трассу; диапазон A1:P64 - целая плитка
+    trace.Clear();
+    sheet.SetCalculationMode(CalculationMode::Manual);
+    sheet.SetCell("A1"_pos, "5");
+    sheet.SetCell("Q1"_pos, "=SUM(A1:P64)+C1");
+    ASSERT_EQUAL(sheet.GetCell("Q1"_pos)->GetValue(), CellInterface::Value(95.0));
+    ASSERT_EQUAL(trace.GetSpans().size(), 1u);
+    ASSERT(trace.GetSpans()[0].pos == "Q1"_pos);
+    ASSERT_EQUAL(trace.GetSpans()[0].cells_read, 7u);
+    ASSERT(sheet.GetCellPtr("Q1"_pos)->IsDirty());
+
+    sheet.SetTrace(nullptr);
+    sheet.SetCalculationMode(CalculationMode::Automatic);
+    sheet.SetCell("A1"_pos, "4");
+    sheet.Recalculate();
+    ASSERT_EQUAL(trace.GetSpans().size(), 1u);
+}
+
+void TestManualCalculation() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "1");
+    sheet.SetCell("B1"_pos, "=A1*10");
+    sheet.SetCell("C1"_pos, "=B1+1");
+    sheet.SetCell("D1"_pos, "=SUM(A1:B1)");
+    ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(11.0));
+    ASSERT_EQUAL(sheet.GetCell("D1"_pos)->GetValue(), CellInterface::Value(11.0));
+
+    sheet.SetCalculationMode(CalculationMode::Manual);
+    const uint64_t evaluated = sheet.GetStats().formulas_evaluated;
+    sheet.SetCell("A1"_pos, "2");
+    // прежние значения с признаком устаревания, без пересчёта
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(10.0));
+    ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(11.0));
+    ASSERT_EQUAL(sheet.GetCell("D1"_pos)->GetValue(), CellInterface::Value(11.0));
+    ASSERT(sheet.GetCellPtr("B1"_pos)->IsDirty());
+    ASSERT(sheet.GetCellPtr("D1"_pos)->IsDirty());
+    ASSERT(!sheet.GetCellPtr("A1"_pos)->IsDirty());
+    ASSERT_EQUAL(sheet.GetStats().formulas_evaluated, evaluated);
+
+    // новая формула вычисляется сразу, по устаревшему аргументу - и сама
+    // считается устаревшей
+    sheet.SetCell("E1"_pos, "=C1*2");
+    ASSERT_EQUAL(sheet.GetCell("E1"_pos)->GetValue(), CellInterface::Value(22.0));
+    ASSERT(sheet.GetCellPtr("E1"_pos)->IsDirty());
+    sheet.SetCell("F1"_pos, "=A1+1");
+    ASSERT_EQUAL(sheet.GetCell("F1"_pos)->GetValue(), CellInterface::Value(3.0));
+    ASSERT(!sheet.GetCellPtr("F1"_pos)->IsDirty());
+
+    // перевёрнутые углы отвергаются, как в ClearRange
+    for (auto [first, last] : {std::pair{"B2"_pos, "B1"_pos}, {"C1"_pos, "B1"_pos}}) {
+        bool rejected = false;
+        try {
+            sheet.Recalculate(first, last);
+        } catch (const InvalidPositionException&) {
+            rejected = true;
+        }
+        ASSERT(rejected);
+    }
+    ASSERT(sheet.GetCellPtr("B1"_pos)->IsDirty());
+
+    sheet.Recalculate("B1"_pos, "B1"_pos);
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(20.0));
+    ASSERT(!sheet.GetCellPtr("B1"_pos)->IsDirty());
+    ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(11.0));
+    ASSERT(sheet.GetCellPtr("C1"_pos)->IsDirty());
+
+    sheet.Recalculate();
+    ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(21.0));
+    ASSERT_EQUAL(sheet.GetCell("D1"_pos)->GetValue(), CellInterface::Value(22.0));
+    ASSERT_EQUAL(sheet.GetCell("E1"_pos)->GetValue(), CellInterface::Value(42.0));
+    for (const char* name : {"B1", "C1", "D1", "E1", "F1"}) {
+        ASSERT(!sheet.GetCellPtr(Position::FromString(name))->IsDirty());
+    }
+
+    // устаревшие значения не попадают в снимок
+    sheet.SetCell("A1"_pos, "3");
+    std::stringstream snapshot;
+    sheet.SaveSnapshot(snapshot);
+    Sheet restored;
+    restored.LoadSnapshot(snapshot);
+    ASSERT_EQUAL(restored.GetCell("C1"_pos)->GetValue(), CellInterface::Value(31.0));
+
+    // возврат в автоматический режим пересчитывает таблицу
+    sheet.SetCalculationMode(CalculationMode::Automatic);
+    ASSERT(!sheet.GetCellPtr("C1"_pos)->IsDirty());
+    ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(31.0));
+    sheet.SetCell("A1"_pos, "4");
+    ASSERT_EQUAL(sheet.GetCell("E1"_pos)->GetValue(), CellInterface::Value(82.0));
+}
+
+void TestSheetVersions() {
+    Sheet sheet;
+    ASSERT_EQUAL(sheet.GetVersion()->GetNumber(), 0u);
+    ASSERT(sheet.GetVersion()->GetCell("A1"_pos) == nullptr);
+
+    sheet.SetCell("A1"_pos, "1");
+    sheet.SetCell("B1"_pos, "=A1*2");
+    sheet.SetCell("Z100"_pos, "'=far");
+    sheet.SetCell("Q1"_pos, "next tile");
+    const std::shared_ptr<const SheetVersion> first = sheet.PublishVersion();
+    ASSERT_EQUAL(first->GetNumber(), 1u);
+    ASSERT(sheet.GetVersion() == first);
+    ASSERT_EQUAL(first->GetValue("B1"_pos), CellInterface::Value(2.0));
+    ASSERT_EQUAL(first->GetValue("Z100"_pos), CellInterface::Value(std::string("=far")));
+    ASSERT_EQUAL(first->GetText("B1"_pos), std::string("=A1*2"));
+    ASSERT_EQUAL(first->GetValue("C3"_pos), CellInterface::Value(std::string()));
+    ASSERT((first->GetPrintableSize() == Size{100, 26}));
+
+    // изменения не видны до публикации и не меняют прежние версии
+    sheet.SetCell("A1"_pos, "5");
+    sheet.SetCell("C1"_pos, "=1/0");
+    ASSERT(sheet.GetVersion() == first);
+    const std::shared_ptr<const SheetVersion> second = sheet.PublishVersion();
+    ASSERT_EQUAL(first->GetValue("B1"_pos), CellInterface::Value(2.0));
+    ASSERT_EQUAL(second->GetValue("B1"_pos), CellInterface::Value(10.0));
+    ASSERT_EQUAL(second->GetValue("C1"_pos),
+                 CellInterface::Value(FormulaError(FormulaError::Category::Arithmetic)));
+    // неизменившаяся плитка общая
+    const int far_key = CellStorage::GetTileKey("Z100"_pos);
+    ASSERT(first->GetBlocks().Get(far_key) != nullptr);
+    ASSERT(first->GetBlocks().Get(far_key) == second->GetBlocks().Get(far_key));
+    const int near_key = CellStorage::GetTileKey("A1"_pos);
+    ASSERT(first->GetBlocks().Get(near_key) != second->GetBlocks().Get(near_key));
+    // соседняя плитка того же куска таблицы блоков тоже общая
+    const int next_key = CellStorage::GetTileKey("Q1"_pos);
+    ASSERT(next_key / SheetVersion::BlockTable::CHUNK_SIZE == near_key / SheetVersion::BlockTable::CHUNK_SIZE);
+    ASSERT(first->GetBlocks().Get(next_key) == second->GetBlocks().Get(next_key));
+
+    sheet.ClearCell("Z100"_pos);
+    const std::shared_ptr<const SheetVersion> third = sheet.PublishVersion();
+    ASSERT(third->GetCell("Z100"_pos) == nullptr);
+    ASSERT(third->GetBlocks().Get(far_key) == nullptr);
+    ASSERT(second->GetBlocks().Get(far_key) != nullptr);
+    std::ostringstream version_values, sheet_values;
+    third->PrintValues(version_values);
+    sheet.PrintValues(sheet_values);
+    ASSERT_EQUAL(version_values.str(), sheet_values.str());
+
+    // в ручном режиме публикуются устаревшие значения
+    sheet.SetCalculationMode(CalculationMode::Manual);
+    sheet.SetCell("A1"_pos, "7");
+    const std::shared_ptr<const SheetVersion> stale = sheet.PublishVersion();
+    ASSERT(stale->IsStale("B1"_pos));
+    ASSERT_EQUAL(stale->GetValue("B1"_pos), CellInterface::Value(10.0));
+    sheet.SetCalculationMode(CalculationMode::Automatic);
+    sheet.SetCell("A1"_pos, "=0");
+    sheet.PublishVersion();
+
+    // читатели видят только согласованные версии, пока писатель их публикует
+    std::atomic<bool> done{false};
+    std::atomic<bool> consistent{true};
+    std::vector<std::thread> readers;
+    for (int i = 0; i < 4; ++i) {
+        readers.emplace_back([&] {
+            uint64_t last_number = 0;
+            while (!done.load()) {
+                const std::shared_ptr<const SheetVersion> version = sheet.GetVersion();
+                const auto a1 = std::get<double>(version->GetValue("A1"_pos));
+                const auto b1 = std::get<double>(version->GetValue("B1"_pos));
+                if (b1 != a1 * 2 || version->GetNumber() < last_number) {
+                    consistent = false;
+                }
+                last_number = version->GetNumber();
+            }
+        });
+    }
+    for (int i = 0; i < 500; ++i) {
+        sheet.SetCell("A1"_pos, "=" + std::to_string(i));
+        sheet.SetCell(Position{i % 200, 5 + i % 20}, std::to_string(i));
+        sheet.PublishVersion();
+    }
+    done = true;
+    for (std::thread& reader : readers) {
+        reader.join();
+    }
+    ASSERT(consistent.load());
+    ASSERT_EQUAL(sheet.GetVersion()->GetValue("B1"_pos), CellInterface::Value(998.0));
+}
 }  // namespace
 
 int main() {
@@ -358,8 +1657,12 @@ int main() {
     RUN_TEST(tr, TestInvalidPosition);
     RUN_TEST(tr, TestSetCellPlainText);
     RUN_TEST(tr, TestClearCell);
+    RUN_TEST(tr, TestSparseFarCell);
+    RUN_TEST(tr, TestPrintableSizeTracking);
     RUN_TEST(tr, TestFormulaArithmetic);
+    RUN_TEST(tr, TestFormulaDeepNesting);
     RUN_TEST(tr, TestFormulaReferences);
+    RUN_TEST(tr, TestFastParserMatchesAntlr);
     RUN_TEST(tr, TestFormulaExpressionFormatting);
     RUN_TEST(tr, TestFormulaReferencedCells);
     RUN_TEST(tr, TestErrorValue);
@@ -370,4 +1673,22 @@ int main() {
     RUN_TEST(tr, TestCellReferences);
     RUN_TEST(tr, TestFormulaIncorrect);
     RUN_TEST(tr, TestCellCircularReferences);
+    RUN_TEST(tr, TestDiamondRecalculation);
+    RUN_TEST(tr, TestBatchEdit);
+    RUN_TEST(tr, TestParallelRecalculation);
+    RUN_TEST(tr, TestRelativeFormulaCopies);
+    RUN_TEST(tr, TestRangeAggregates);
+    RUN_TEST(tr, TestRangeDependencyIndex);
+    RUN_TEST(tr, TestIncrementalCycleDetection);
+    RUN_TEST(tr, TestColumnarNumericValues);
+    RUN_TEST(tr, TestArenaAllocation);
+    RUN_TEST(tr, TestPooledCells);
+    RUN_TEST(tr, TestPrintBuffered);
+    RUN_TEST(tr, TestImportTexts);
+    RUN_TEST(tr, TestSnapshot);
+    RUN_TEST(tr, TestEditJournal);
+    RUN_TEST(tr, TestSheetStats);
+    RUN_TEST(tr, TestRecalcTrace);
+    RUN_TEST(tr, TestManualCalculation);
+    RUN_TEST(tr, TestSheetVersions);
 }
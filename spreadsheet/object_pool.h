@@ -0,0 +1,82 @@
+#pragma once
+
+#include <cassert>
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <utility>
+#include <vector>
+
+// Пул объектов одного типа. Память берётся блоками по SLAB_SIZE объектов,
+// освободившиеся места переиспользуются через список свободных мест и
+// возвращаются системе только вместе с пулом. Адреса объектов не меняются.
+// К моменту разрушения пула все объекты должны быть удалены через Destroy().
+template <typename T, size_t SLAB_SIZE = 256>
+class ObjectPool {
+public:
+    ObjectPool() = default;
+    ObjectPool(const ObjectPool&) = delete;
+    ObjectPool& operator=(const ObjectPool&) = delete;
+
+    ~ObjectPool() {
+        assert(size_ == 0);
+    }
+
+    template <typename... Args>
+    T* Create(Args&&... args) {
+        if(free_ == nullptr) {
+            AddSlab();
+        }
+        // объект займёт место ссылки на следующее свободное место
+        Slot* slot = free_;
+        free_ = slot->next;
+        T* object;
+        try {
+            object = new (slot->storage) T(std::forward<Args>(args)...);
+        } catch(...) {
+            slot->next = free_;
+            free_ = slot;
+            throw;
+        }
+        ++size_;
+        return object;
+    }
+
+    void Destroy(T* object) {
+        object->~T();
+        Slot* slot = reinterpret_cast<Slot*>(object);
+        slot->next = free_;
+        free_ = slot;
+        --size_;
+    }
+
+    // Число живых объектов
+    size_t GetSize() const {
+        return size_;
+    }
+
+    // Число мест во всех блоках
+    size_t GetCapacity() const {
+        return slabs_.size() * SLAB_SIZE;
+    }
+
+private:
+    union Slot {
+        Slot* next;
+        alignas(T) std::byte storage[sizeof(T)];
+    };
+
+    void AddSlab() {
+        auto slab = std::make_unique<Slot[]>(SLAB_SIZE);
+        for(size_t i = 0; i + 1 < SLAB_SIZE; ++i) {
+            slab[i].next = &slab[i + 1];
+        }
+        slab[SLAB_SIZE - 1].next = free_;
+        free_ = &slab[0];
+        slabs_.push_back(std::move(slab));
+    }
+
+    std::vector<std::unique_ptr<Slot[]>> slabs_;
+    Slot* free_ = nullptr;
+    size_t size_ = 0;
+};
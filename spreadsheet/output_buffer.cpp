@@ -0,0 +1,70 @@
+#include "output_buffer.h"
+
+#include <algorithm>
+#include <charconv>
+#include <cstring>
+#include <ios>
+#include <locale>
+
+OutputBuffer::OutputBuffer(std::ostream& output, size_t capacity)
+    : output_{output}, buffer_(std::max<size_t>(capacity, 64)) {
+    const std::ios_base::fmtflags flags = output.flags();
+    const std::ios_base::fmtflags float_field = flags & std::ios_base::floatfield;
+    const std::ios_base::fmtflags unsupported =
+        std::ios_base::showpos | std::ios_base::showpoint | std::ios_base::uppercase;
+    format_numbers_ = (flags & unsupported) == 0 && output.width() == 0 &&
+                      float_field != std::ios_base::floatfield && output.getloc() == std::locale::classic();
+    if(float_field == std::ios_base::fixed) {
+        number_format_ = std::chars_format::fixed;
+    } else if(float_field == std::ios_base::scientific) {
+        number_format_ = std::chars_format::scientific;
+    }
+    precision_ = static_cast<int>(output.precision());
+}
+
+OutputBuffer::~OutputBuffer() {
+    try {
+        Flush();
+    } catch(...) {
+        // ошибка потока видна по его состоянию
+    }
+}
+
+void OutputBuffer::Write(std::string_view text) {
+    while(!text.empty()) {
+        if(size_ == buffer_.size()) {
+            Flush();
+        }
+        const size_t count = std::min(text.size(), buffer_.size() - size_);
+        std::memcpy(buffer_.data() + size_, text.data(), count);
+        size_ += count;
+        text.remove_prefix(count);
+    }
+}
+
+void OutputBuffer::Write(double number) {
+    // запись с точностью по умолчанию, вида -1.23457e-308, заметно короче
+    constexpr size_t MIN_NUMBER_SPACE = 32;
+    if(format_numbers_) {
+        if(buffer_.size() - size_ < MIN_NUMBER_SPACE) {
+            Flush();
+        }
+        char* begin = buffer_.data() + size_;
+        auto [end, ec] = std::to_chars(begin, buffer_.data() + buffer_.size(), number, number_format_,
+                                       precision_);
+        if(ec == std::errc()) {
+            size_ += end - begin;
+            return;
+        }
+        // запись длиннее свободного места, например большое число в fixed
+    }
+    Flush();
+    output_ << number;
+}
+
+void OutputBuffer::Flush() {
+    if(size_ > 0) {
+        output_.write(buffer_.data(), static_cast<std::streamsize>(size_));
+        size_ = 0;
+    }
+}
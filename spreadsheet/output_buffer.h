@@ -0,0 +1,45 @@
+#pragma once
+
+#include <charconv>
+#include <cstddef>
+#include <ostream>
+#include <string_view>
+#include <vector>
+
+// Буфер вывода большого объёма. Данные копируются в буфер фиксированного
+// размера и передаются в поток целыми кусками, когда буфер заполнится, при
+// вызове Flush() или при разрушении буфера. Числа форматируются по
+// настройкам потока на момент создания буфера.
+class OutputBuffer {
+public:
+    static constexpr size_t DEFAULT_CAPACITY = 64 * 1024;
+
+    explicit OutputBuffer(std::ostream& output, size_t capacity = DEFAULT_CAPACITY);
+    OutputBuffer(const OutputBuffer&) = delete;
+    OutputBuffer& operator=(const OutputBuffer&) = delete;
+    ~OutputBuffer();
+
+    void Write(char c) {
+        if(size_ == buffer_.size()) {
+            Flush();
+        }
+        buffer_[size_++] = c;
+    }
+    void Write(std::string_view text);
+    // Число в том же виде, что и operator<< потока. Точность и формат
+    // (general, fixed, scientific) обрабатываются в буфере, при остальных
+    // настройках (ширина, знак, шестнадцатеричный формат, не классическая
+    // локаль) число передаётся потоку.
+    void Write(double number);
+
+    void Flush();
+
+private:
+    std::ostream& output_;
+    std::vector<char> buffer_;
+    size_t size_ = 0;
+    // формат чисел потока, если буфер может его воспроизвести
+    bool format_numbers_ = false;
+    std::chars_format number_format_ = std::chars_format::general;
+    int precision_ = 6;
+};
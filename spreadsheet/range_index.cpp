@@ -0,0 +1,89 @@
+#include "range_index.h"
+
+#include <algorithm>
+#include <cassert>
+
+template <typename Func>
+void RangeIndex::ForEachNode(int first, int last, int leaf_count, Func func) {
+    int left = first + leaf_count;
+    int right = last + leaf_count + 1;
+    while(left < right) {
+        if(left & 1) {
+            func(left++);
+        }
+        if(right & 1) {
+            func(--right);
+        }
+        left >>= 1;
+        right >>= 1;
+    }
+}
+
+void RangeIndex::Add(const CellRange& range, Cell* dependent) {
+    assert(range.first.IsValid() && range.last.IsValid());
+    if(nodes_.empty()) {
+        nodes_.resize(2 * ROW_LEAF_COUNT);
+    }
+
+    ForEachNode(range.first.row, range.last.row, ROW_LEAF_COUNT, [&](int row_node) {
+        ColumnNodes& columns = nodes_[row_node];
+        ForEachNode(range.first.col, range.last.col, COL_LEAF_COUNT, [&](int col_node) {
+            columns[col_node].push_back(dependent);
+        });
+    });
+    ++size_;
+}
+
+void RangeIndex::Remove(const CellRange& range, Cell* dependent) {
+    if(nodes_.empty()) {
+        return;
+    }
+
+    bool removed = false;
+    ForEachNode(range.first.row, range.last.row, ROW_LEAF_COUNT, [&](int row_node) {
+        ColumnNodes& columns = nodes_[row_node];
+        ForEachNode(range.first.col, range.last.col, COL_LEAF_COUNT, [&](int col_node) {
+            auto node_it = columns.find(col_node);
+            if(node_it == columns.end()) {
+                return;
+            }
+            auto& dependents = node_it->second;
+            auto it = std::find(dependents.begin(), dependents.end(), dependent);
+            if(it == dependents.end()) {
+                return;
+            }
+            *it = dependents.back();
+            dependents.pop_back();
+            if(dependents.empty()) {
+                columns.erase(node_it);
+            }
+            removed = true;
+        });
+    });
+    if(removed) {
+        --size_;
+    }
+}
+
+void RangeIndex::GetDependents(Position pos, std::vector<Cell*>& result) const {
+    if(size_ == 0 || !pos.IsValid()) {
+        return;
+    }
+
+    for(int row_node = pos.row + ROW_LEAF_COUNT; row_node > 0; row_node >>= 1) {
+        const ColumnNodes& columns = nodes_[row_node];
+        if(columns.empty()) {
+            continue;
+        }
+        for(int col_node = pos.col + COL_LEAF_COUNT; col_node > 0; col_node >>= 1) {
+            auto it = columns.find(col_node);
+            if(it != columns.end()) {
+                result.insert(result.end(), it->second.begin(), it->second.end());
+            }
+        }
+    }
+}
+
+size_t RangeIndex::GetSize() const {
+    return size_;
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include "common.h"
+
+#include <cstddef>
+#include <unordered_map>
+#include <vector>
+
+class Cell;
+
+// Индекс диапазонов, на которые ссылаются формулы. Диапазон хранится
+// целиком, а не рёбрами в каждой своей ячейке, поэтому ссылка на миллион
+// ячеек стоит столько же, сколько ссылка на одну.
+// Устроен как дерево отрезков по строкам, в узлах которого - деревья
+// отрезков по столбцам: диапазон записывается в узлы, покрывающие его
+// строки, а в каждом из них - в узлы, покрывающие его столбцы. Ячейки,
+// зависящие от позиции, ищутся на путях от листьев её строки и столбца к
+// корням, за O(log^2) плюс число найденных, сколько бы диапазонов ни
+// лежало в тех же строках.
+class RangeIndex {
+public:
+    void Add(const CellRange& range, Cell* dependent);
+    // Удаляет одну запись, добавленную Add с теми же аргументами
+    void Remove(const CellRange& range, Cell* dependent);
+
+    // Добавляет в result формулы, ссылающиеся на диапазоны, которые содержат
+    // pos. Формула, у которой таких диапазонов несколько, добавляется
+    // несколько раз.
+    void GetDependents(Position pos, std::vector<Cell*>& result) const;
+
+    size_t GetSize() const;
+
+private:
+    // число листьев деревьев по строкам и по столбцам, степени двойки
+    static constexpr int ROW_LEAF_COUNT = Position::MAX_ROWS;
+    static constexpr int COL_LEAF_COUNT = Position::MAX_COLS;
+
+    // Вызывает func(node) для узлов дерева с leaf_count листьями, покрывающих
+    // отрезок [first, last]
+    template <typename Func>
+    static void ForEachNode(int first, int last, int leaf_count, Func func);
+
+    // узел дерева по строкам: формулы по узлам дерева по столбцам, только
+    // непустые
+    using ColumnNodes = std::unordered_map<int, std::vector<Cell*>>;
+
+    // узлы нумеруются с единицы, потомки узла i - 2i и 2i + 1; память под
+    // узлы по строкам выделяется при добавлении первого диапазона
+    std::vector<ColumnNodes> nodes_;
+    size_t size_ = 0;
+};
@@ -0,0 +1,120 @@
+#include "recalc_trace.h"
+
+#include "output_buffer.h"
+
+#include <algorithm>
+#include <string>
+#include <unordered_map>
+
+namespace {
+// Микросекунды с дробной частью, как принято в Chrome trace
+void WriteMicroseconds(OutputBuffer& output, std::int64_t ns) {
+    ns = std::max<std::int64_t>(ns, 0);
+    output.Write(std::to_string(ns / 1000));
+    const std::string fraction = std::to_string(ns % 1000 + 1000);
+    output.Write('.');
+    output.Write(std::string_view(fraction).substr(1));
+}
+}  // namespace
+
+RecalcTrace::RecalcTrace()
+    : start_{std::chrono::steady_clock::now()} {
+}
+
+std::int64_t RecalcTrace::GetElapsedNs() const {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start_)
+        .count();
+}
+
+void RecalcTrace::Append(std::vector<TraceSpan> spans) {
+    std::lock_guard lock(mutex_);
+    const size_t offset = spans_.size();
+    for(TraceSpan& span : spans) {
+        if(span.predecessor != TraceSpan::NO_PREDECESSOR) {
+            span.predecessor += offset;
+        }
+        spans_.push_back(span);
+    }
+}
+
+std::vector<TraceSpan> RecalcTrace::GetSpans() const {
+    std::lock_guard lock(mutex_);
+    return spans_;
+}
+
+void RecalcTrace::Clear() {
+    std::lock_guard lock(mutex_);
+    spans_.clear();
+}
+
+void RecalcTrace::WriteChromeTrace(std::ostream& output) const {
+    const std::vector<TraceSpan> spans = GetSpans();
+    // потоки нумеруются в порядке первого появления
+    std::unordered_map<std::thread::id, size_t> thread_numbers;
+
+    OutputBuffer buffer(output);
+    buffer.Write("{\"traceEvents\":[");
+    for(size_t i = 0; i < spans.size(); ++i) {
+        const TraceSpan& span = spans[i];
+        const size_t thread = thread_numbers.emplace(span.thread, thread_numbers.size()).first->second;
+        buffer.Write(i == 0 ? "\n" : ",\n");
+        buffer.Write("{\"name\":\"");
+        buffer.Write(span.pos.ToString());
+        buffer.Write("\",\"cat\":\"recalc\",\"ph\":\"X\",\"pid\":1,\"tid\":");
+        buffer.Write(std::to_string(thread));
+        buffer.Write(",\"ts\":");
+        WriteMicroseconds(buffer, span.start_ns);
+        buffer.Write(",\"dur\":");
+        WriteMicroseconds(buffer, span.duration_ns);
+        buffer.Write(",\"args\":{\"depth\":");
+        buffer.Write(std::to_string(span.depth));
+        buffer.Write(",\"cells_read\":");
+        buffer.Write(std::to_string(span.cells_read));
+        buffer.Write("}}");
+    }
+    buffer.Write("\n],\"displayTimeUnit\":\"ns\"}\n");
+}
+
+RecalcTrace::Report RecalcTrace::BuildReport(size_t top_count) const {
+    const std::vector<TraceSpan> spans = GetSpans();
+    Report report;
+
+    report.hottest = spans;
+    auto longer = [](const TraceSpan& lhs, const TraceSpan& rhs) {
+        return lhs.duration_ns > rhs.duration_ns;
+    };
+    if(report.hottest.size() > top_count) {
+        std::partial_sort(report.hottest.begin(), report.hottest.begin() + top_count, report.hottest.end(),
+                          longer);
+        report.hottest.resize(top_count);
+    } else {
+        std::sort(report.hottest.begin(), report.hottest.end(), longer);
+    }
+
+    auto last = std::max_element(spans.begin(), spans.end(), [](const TraceSpan& lhs, const TraceSpan& rhs) {
+        return lhs.path_ns < rhs.path_ns;
+    });
+    if(last == spans.end()) {
+        return report;
+    }
+    report.critical_path_ns = last->path_ns;
+    for(size_t i = last - spans.begin(); i != TraceSpan::NO_PREDECESSOR; i = spans[i].predecessor) {
+        report.critical_path.push_back(spans[i].pos);
+    }
+    std::reverse(report.critical_path.begin(), report.critical_path.end());
+    return report;
+}
+
+void RecalcTrace::PrintReport(std::ostream& output, size_t top_count) const {
+    const Report report = BuildReport(top_count);
+    output << "Hottest cells:\n";
+    for(const TraceSpan& span : report.hottest) {
+        output << "  " << span.pos.ToString() << '\t' << span.duration_ns << " ns\tdepth " << span.depth
+               << "\tcells read " << span.cells_read << '\n';
+    }
+    output << "Critical path (" << report.critical_path_ns << " ns):";
+    for(size_t i = 0; i < report.critical_path.size(); ++i) {
+        output << (i == 0 ? " " : " -> ") << report.critical_path[i].ToString();
+    }
+    output << '\n';
+}
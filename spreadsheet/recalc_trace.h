@@ -0,0 +1,72 @@
+#pragma once
+
+#include "common.h"
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <ostream>
+#include <thread>
+#include <vector>
+
+// Вычисление одной формулы при пересчёте
+struct TraceSpan {
+    static constexpr size_t NO_PREDECESSOR = static_cast<size_t>(-1);
+
+    Position pos;
+    // начало относительно создания трассы и длительность
+    std::int64_t start_ns = 0;
+    std::int64_t duration_ns = 0;
+    // уровень в графе пересчёта: 0, если формула не зависит от других
+    // пересчитываемых в том же вызове формул
+    std::uint32_t depth = 0;
+    // ячейки, на которые ссылается формула (для диапазонов - существующие)
+    std::uint32_t cells_read = 0;
+    std::thread::id thread;
+    // длительность самой долгой цепочки пересчёта, которая заканчивается
+    // этой формулой, и номер предыдущего вычисления в этой цепочке
+    std::int64_t path_ns = 0;
+    size_t predecessor = NO_PREDECESSOR;
+};
+
+// Трасса пересчёта, подключаемая через Sheet::SetTrace(). Таблица добавляет
+// в неё вычисления формул каждого пересчёта. Трассу можно записать в формате
+// Chrome trace (chrome://tracing, Perfetto) или свести в отчёт о самых
+// дорогих ячейках и самой долгой цепочке зависимостей.
+class RecalcTrace {
+public:
+    struct Report {
+        // самые долгие вычисления по убыванию длительности
+        std::vector<TraceSpan> hottest;
+        // самая долгая цепочка: от первой вычисленной формулы к последней
+        std::vector<Position> critical_path;
+        std::int64_t critical_path_ns = 0;
+    };
+
+    RecalcTrace();
+    RecalcTrace(const RecalcTrace&) = delete;
+    RecalcTrace& operator=(const RecalcTrace&) = delete;
+
+    // Время с момента создания трассы
+    std::int64_t GetElapsedNs() const;
+
+    // Добавляет вычисления одного пересчёта. Номера predecessor отсчитываются
+    // от начала spans и переводятся в номера всей трассы.
+    void Append(std::vector<TraceSpan> spans);
+
+    std::vector<TraceSpan> GetSpans() const;
+    void Clear();
+
+    // Записывает события "X" в формате Chrome trace JSON
+    void WriteChromeTrace(std::ostream& output) const;
+
+    Report BuildReport(size_t top_count) const;
+    // Печатает отчёт BuildReport() в текстовом виде
+    void PrintReport(std::ostream& output, size_t top_count) const;
+
+private:
+    const std::chrono::steady_clock::time_point start_;
+    mutable std::mutex mutex_;
+    std::vector<TraceSpan> spans_;
+};
@@ -1,12 +1,27 @@
 #include "sheet.h"
 
+#include "binary_io.h"
 #include "cell.h"
 #include "common.h"
+#include "journal.h"
+#include "output_buffer.h"
+#include "recalc_trace.h"
+#include "text_table_reader.h"
 
 #include <algorithm>
+#include <array>
+#include <cstdint>
 #include <functional>
+#include <iterator>
 #include <iostream>
+#include <memory>
 #include <optional>
+#include <set>
+#include <stdexcept>
+#include <string_view>
+#include <thread>
+#include <unordered_set>
+#include <utility>
 
 using namespace std::literals;
 
@@ -15,12 +30,28 @@ void Sheet::SetCell(Position pos, std::string text) {
         throw InvalidPositionException("Sheet::SetCell: out of range");
     }
 
-    Resize(pos);
-    if(cells_[pos.row][pos.col].get() == nullptr) {
-        cells_[pos.row][pos.col] = std::make_unique<Cell>(*this);
+    if(in_batch_) {
+        batch_.emplace_back(pos, std::move(text));
+        return;
     }
 
-    dynamic_cast<Cell*>(cells_[pos.row][pos.col].get())->Set(std::move(text),pos);
+    const bool created = cells_.Get(pos) == nullptr;
+    Cell& cell = GetOrCreateCell(pos);
+    const bool was_empty = cell.IsEmpty();
+    try {
+        cell.Set(std::move(text));
+    } catch(...) {
+        if(created) {
+            EraseIfUnused(pos);
+        }
+        throw;
+    }
+
+    UpdatePrintable(pos, was_empty, cell.IsEmpty());
+    if(journal_) {
+        journal_->Record(pos, cell.GetText());
+        journal_->CommitIfFull();
+    }
 }
 
 const CellInterface* Sheet::GetCell(Position pos) const {
@@ -28,11 +59,7 @@ const CellInterface* Sheet::GetCell(Position pos) const {
         throw InvalidPositionException("Sheet::GetCell: out of range");
     }
 
-    if(!(min_print_size_.rows - 1 < pos.row || 
-        min_print_size_.cols - 1 < pos.col)) {
-        return cells_.at(pos.row).at(pos.col).get();
-    }
-    return nullptr;
+    return cells_.Get(pos);
 }
 
 CellInterface* Sheet::GetCell(Position pos) {
@@ -40,136 +67,959 @@ CellInterface* Sheet::GetCell(Position pos) {
         throw InvalidPositionException("Sheet::GetCell: out of range");
     }
 
-    if(!(min_print_size_.rows - 1 < pos.row || 
-        min_print_size_.cols - 1 < pos.col)) {
-        return cells_.at(pos.row).at(pos.col).get();
-    }
-    return nullptr;
+    return cells_.Get(pos);
 }
 
-std::unique_ptr<CellInterface>& Sheet::GetUniqPtrCell(Position pos) {
-    return cells_[pos.row][pos.col];
+Cell& Sheet::GetOrCreateCell(Position pos) {
+    Cell* cell = cells_.Get(pos);
+    if(cell != nullptr) {
+        return *cell;
+    }
+    return cells_.Create(*this, pos);
 }
 
 void Sheet::ClearCell(Position pos) {
-    if(pos.col < 0 || pos.row < 0 || pos.col >= Position::MAX_COLS || 
-        pos.row >= Position::MAX_ROWS){
-            throw InvalidPositionException("Sheet::ClearCell: out of range");
+    if(!pos.IsValid()) {
+        throw InvalidPositionException("Sheet::ClearCell: out of range");
+    }
+
+    if(in_batch_) {
+        batch_.emplace_back(pos, std::string{});
+        return;
+    }
+
+    Cell* cell = cells_.Get(pos);
+    if(cell == nullptr) {
+        return;
+    }
+    ClearCellContent(*cell);
+    EraseIfUnused(pos);
+    if(journal_) {
+        journal_->CommitIfFull();
+    }
+}
+
+void Sheet::ClearRange(Position first, Position last) {
+    if(!first.IsValid() || !last.IsValid() || last.row < first.row || last.col < first.col) {
+        throw InvalidPositionException("Sheet::ClearRange: out of range");
+    }
+
+    const std::vector<Position> positions = cells_.GetPositionsInRange(first, last);
+    for(Position pos : positions) {
+        ClearCellContent(*cells_.Get(pos));
+    }
+    // удаляем ячейки только после очистки всего диапазона: ссылки между
+    // ячейками диапазона к этому моменту уже исчезли
+    for(Position pos : positions) {
+        EraseIfUnused(pos);
+    }
+    if(journal_) {
+        journal_->CommitIfFull();
+    }
+}
+
+std::vector<Cell*> Sheet::GetCellsInRange(const CellRange& range) const {
+    std::vector<Cell*> cells;
+    if(!range.first.IsValid() || !range.last.IsValid()) {
+        return cells;
+    }
+    for(Position pos : cells_.GetPositionsInRange(range.first, range.last)) {
+        cells.push_back(cells_.Get(pos));
+    }
+    return cells;
+}
+
+void Sheet::AddRangeDependent(const CellRange& range, Cell* dependent) {
+    range_dependents_.Add(range, dependent);
+}
+
+void Sheet::RemoveRangeDependent(const CellRange& range, Cell* dependent) {
+    range_dependents_.Remove(range, dependent);
+}
+
+void Sheet::GetRangeDependents(Position pos, std::vector<Cell*>& result) const {
+    range_dependents_.GetDependents(pos, result);
+}
+
+std::int64_t Sheet::PrependToOrder() {
+    return --first_order_;
+}
+
+std::int64_t Sheet::AppendToOrder() {
+    return ++last_order_;
+}
+
+Size Sheet::GetPrintableSize() const {
+    return printable_cells_.GetBounds();
+}
+
+void Sheet::ClearCellContent(Cell& cell) {
+    if(!cell.IsEmpty()) {
+        cell.Clear();
+        printable_cells_.Remove(cell.GetPosition());
+        if(journal_) {
+            journal_->Record(cell.GetPosition(), {});
         }
+    }
+}
 
-    if(!(min_print_size_.rows - 1 < pos.row || 
-        min_print_size_.cols - 1 < pos.col)) {
+void Sheet::UpdatePrintable(Position pos, bool was_empty, bool is_empty) {
+    if(was_empty && !is_empty) {
+        printable_cells_.Add(pos);
+    } else if(!was_empty && is_empty) {
+        printable_cells_.Remove(pos);
+    }
+}
 
-        dynamic_cast<Cell*>(cells_[pos.row][pos.col].get())->Clear();
-        cells_[pos.row][pos.col].reset(nullptr);
+void Sheet::EraseIfUnused(Position pos) {
+    // ячейка, на которую ссылаются формулы, хранит их список, поэтому
+    // остаётся в таблице пустой
+    const Cell* cell = cells_.Get(pos);
+    if(cell != nullptr && cell->IsEmpty() && cell->GetDependentCells().empty()) {
+        cells_.Erase(pos);
+    }
+}
 
-        for(int row = min_print_size_.rows - 1;row >= 0; --row) {
-            int brk = false;
-            for(int col = min_print_size_.cols - 1;col >= 0; --col) {
-                if(cells_[row][col].get() != nullptr) {
-                    cells_.resize(row+1);
-                    brk = true;
-                    break;
-                }
-                if(row==0 && col == 0) {
-                    cells_.resize(0);
+void Sheet::PrintValues(std::ostream& output) const {
+    SheetCounters::Timer timer(counters_, SheetCounters::Latency::Print);
+    OutputBuffer buffer(output);
+    const Size size = GetPrintableSize();
+    for(int i = 0; i < size.rows; ++i) {
+        for(int k = 0; k < size.cols; ++k) {
+            const Cell* cell = cells_.Get({i, k});
+            if(cell != nullptr) {
+                const Cell::ValueView value = cell->GetValueView();
+                if(const auto* text = std::get_if<std::string_view>(&value)) {
+                    buffer.Write(*text);
+                } else if(const double* number = std::get_if<double>(&value)) {
+                    buffer.Write(*number);
+                } else {
+                    buffer.Write(std::get<FormulaError>(value).ToString());
                 }
             }
-            if(brk) {
-                break;
+            if(k != size.cols-1) {
+                buffer.Write('\t');
             }
         }
-        min_print_size_.rows = cells_.size();
+        buffer.Write('\n');
+    }
+    buffer.Flush();
+}
 
-        for(int col = min_print_size_.cols - 1;col >= 0; --col) {
-            int brk = false;
-            for(int row = min_print_size_.rows - 1;row >= 0; --row) {
-                if(cells_[row][col].get() != nullptr) {
-                    for(auto& r : cells_) {
-                        r.resize(col+1);
-                    }
-                    brk = true;
-                    break;
+void Sheet::PrintTexts(std::ostream& output) const {
+    SheetCounters::Timer timer(counters_, SheetCounters::Latency::Print);
+    OutputBuffer buffer(output);
+    const Size size = GetPrintableSize();
+    for(int i = 0; i < size.rows; ++i) {
+        for(int k = 0; k < size.cols; ++k) {
+            const Cell* cell = cells_.Get({i, k});
+            if(cell != nullptr) {
+                buffer.Write(cell->GetText());
+            }
+            if(k != size.cols-1) {
+                buffer.Write('\t');
+            }
+        }
+        buffer.Write('\n');
+    }
+    buffer.Flush();
+}
+
+void Sheet::Recalculate() {
+    std::vector<const Cell*> cells;
+    for(Position pos : dirty_cells_) {
+        const Cell* cell = GetCellPtr(pos);
+        if(cell != nullptr && cell->IsDirty()) {
+            cells.push_back(cell);
+        }
+    }
+    dirty_cells_.clear();
+    RecalculateCells(cells);
+}
+
+void Sheet::Recalculate(Position first, Position last) {
+    if(!first.IsValid() || !last.IsValid() || last.row < first.row || last.col < first.col) {
+        throw InvalidPositionException("Sheet::Recalculate: out of range");
+    }
+    std::vector<const Cell*> cells;
+    for(const Cell* cell : GetCellsInRange({first, last})) {
+        if(cell->IsDirty()) {
+            cells.push_back(cell);
+        }
+    }
+    RecalculateCells(cells);
+}
+
+void Sheet::RecalculateCell(const Cell& cell) {
+    RecalculateCells({&cell}, calculation_mode_ == CalculationMode::Manual);
+}
+
+void Sheet::SetCalculationMode(CalculationMode mode) {
+    calculation_mode_ = mode;
+    if(mode == CalculationMode::Automatic) {
+        Recalculate();
+    }
+}
+
+CalculationMode Sheet::GetCalculationMode() const {
+    return calculation_mode_;
+}
+
+void Sheet::AddDirtyCell(Position pos) {
+    dirty_cells_.push_back(pos);
+    if(dirty_cells_.size() < dirty_cells_limit_) {
+        return;
+    }
+
+    // избавляемся от записей о ячейках, которые уже были пересчитаны
+    auto is_clean = [this](Position dirty_pos) {
+        const Cell* cell = GetCellPtr(dirty_pos);
+        return cell == nullptr || !cell->IsDirty();
+    };
+    dirty_cells_.erase(std::remove_if(dirty_cells_.begin(), dirty_cells_.end(), is_clean),
+                       dirty_cells_.end());
+    dirty_cells_limit_ = std::max<size_t>(1024, dirty_cells_.size() * 2);
+}
+
+double Sheet::GetCellNumber(Position pos) const {
+    const NumericValue value = cells_.GetNumericValue(pos);
+    if(value.tag == NumericValue::Tag::Stale) {
+        return cells_.Get(pos)->GetNumber();
+    }
+    return value.ToNumber();
+}
+
+void Sheet::SetNumericValue(Position pos, NumericValue value) {
+    cells_.SetNumericValue(pos, value);
+}
+
+void Sheet::GatherRangeValues(
+    Position first, Position last,
+    const std::function<void(const double* values, size_t count)>& consumer) const {
+    if(!first.IsValid() || !last.IsValid()) {
+        throw FormulaError(FormulaError::Category::Ref);
+    }
+
+    // подряд идущие числа столбца передаются прямо из хранилища, агрегатные
+    // функции обрабатывают их векторизованными циклами
+    cells_.ForEachColumnSegment(first, last, [&](Position top, const double* numbers,
+                                                 const NumericValue::Tag* tags, int count) {
+        int run_begin = 0;
+        for(int i = 0; i < count; ++i) {
+            if(tags[i] == NumericValue::Tag::Number) {
+                continue;
+            }
+            if(run_begin < i) {
+                consumer(numbers + run_begin, i - run_begin);
+            }
+            run_begin = i + 1;
+
+            std::optional<double> number;
+            if(tags[i] == NumericValue::Tag::Stale) {
+                number = cells_.Get({top.row + i, top.col})->GetNumberInRange();
+            } else {
+                number = NumericValue{tags[i], numbers[i]}.ToRangeNumber();
+            }
+            if(number) {
+                consumer(&*number, 1);
+            }
+        }
+        if(run_begin < count) {
+            consumer(numbers + run_begin, count - run_begin);
+        }
+    });
+}
+
+Cell* Sheet::GetCellPtr(Position pos) const {
+    if(!pos.IsValid()) {
+        return nullptr;
+    }
+    return cells_.Get(pos);
+}
+
+void Sheet::RecalculateCells(const std::vector<const Cell*>& cells, bool keep_stale) {
+    SheetCounters::Timer timer(counters_, SheetCounters::Latency::Evaluate);
+    // Обход в глубину по устаревшим ячейкам, от которых зависят переданные,
+    // без рекурсии: ячейка попадает в order после всех своих аргументов.
+    // При keep_stale обходятся только аргументы, ещё не имеющие значения.
+    std::unordered_set<const Cell*> visited;
+    std::vector<const Cell*> order;
+    std::vector<std::pair<const Cell*, bool>> stack;
+    for(const Cell* root : cells) {
+        stack.push_back({root, false});
+        while(!stack.empty()) {
+            auto [cell, expanded] = stack.back();
+            if(expanded) {
+                stack.pop_back();
+                order.push_back(cell);
+                continue;
+            }
+            if(!visited.insert(cell).second) {
+                stack.pop_back();
+                continue;
+            }
+
+            stack.back().second = true;
+            for(const Cell* arg : GetDirtyArguments(*cell)) {
+                if(!visited.count(arg) && !(keep_stale && arg->HasValue())) {
+                    stack.push_back({arg, false});
                 }
-            }       
-            if(brk) {
-                break;
             }
         }
-        if(!cells_.empty()) {
-            min_print_size_.cols = cells_[0].size();
+    }
+
+    counters_.Add(SheetCounters::Counter::FormulasEvaluated, order.size());
+    auto recompute = [&](const Cell& cell) {
+        cell.Recompute();
+        // формула, прочитавшая устаревший аргумент, сама остаётся устаревшей
+        // и будет пересчитана следующим Recalculate()
+        if(keep_stale && !GetDirtyArguments(cell).empty()) {
+            cell.MarkStale();
+        }
+    };
+    // при keep_stale ячейки пересчитываются последовательно
+    const bool parallel = thread_pool_ && !keep_stale;
+    if(!parallel && !trace_) {
+        for(const Cell* cell : order) {
+            recompute(*cell);
+        }
+        return;
+    }
+
+    // уровень ячейки на единицу больше максимального уровня её устаревших
+    // аргументов; ячейки одного уровня друг от друга не зависят
+    const std::vector<std::vector<size_t>> arguments = GetOrderArguments(order);
+    std::vector<size_t> levels(order.size(), 0);
+    std::vector<std::vector<size_t>> indices_by_level;
+    for(size_t i = 0; i < order.size(); ++i) {
+        for(size_t arg : arguments[i]) {
+            levels[i] = std::max(levels[i], levels[arg] + 1);
+        }
+        if(indices_by_level.size() <= levels[i]) {
+            indices_by_level.resize(levels[i] + 1);
+        }
+        indices_by_level[levels[i]].push_back(i);
+    }
+
+    if(!trace_) {
+        for(const auto& level_indices : indices_by_level) {
+            thread_pool_->ParallelFor(level_indices.size(), [&](size_t i) {
+                order[level_indices[i]]->Recompute();
+            });
+        }
+        return;
+    }
+
+    // каждый поток заполняет только места своих ячеек
+    std::vector<TraceSpan> spans(order.size());
+    auto recompute_traced = [&](size_t i) {
+        const Cell& cell = *order[i];
+        TraceSpan& span = spans[i];
+        span.pos = cell.GetPosition();
+        span.depth = static_cast<std::uint32_t>(levels[i]);
+        span.thread = std::this_thread::get_id();
+        // ячейки диапазонов считаются по плиткам, без построения списков
+        size_t cells_read = cell.GetCellReferences().size();
+        for(const CellRange& range : cell.GetRangeReferences()) {
+            if(range.first.IsValid() && range.last.IsValid()) {
+                cells_read += cells_.CountCellsInRange(range.first, range.last);
+            }
+        }
+        span.cells_read = static_cast<std::uint32_t>(cells_read);
+        span.start_ns = trace_->GetElapsedNs();
+        recompute(cell);
+        span.duration_ns = trace_->GetElapsedNs() - span.start_ns;
+    };
+    for(const auto& level_indices : indices_by_level) {
+        if(parallel) {
+            thread_pool_->ParallelFor(level_indices.size(), [&](size_t i) {
+                recompute_traced(level_indices[i]);
+            });
         } else {
-            min_print_size_.cols = 0;
+            for(size_t i : level_indices) {
+                recompute_traced(i);
+            }
         }
+    }
 
+    // аргументы стоят в order раньше зависящих от них ячеек
+    for(size_t i = 0; i < order.size(); ++i) {
+        std::int64_t longest_argument_path = 0;
+        for(size_t arg : arguments[i]) {
+            if(spans[arg].path_ns >= longest_argument_path) {
+                longest_argument_path = spans[arg].path_ns;
+                spans[i].predecessor = arg;
+            }
+        }
+        spans[i].path_ns = longest_argument_path + spans[i].duration_ns;
     }
+    trace_->Append(std::move(spans));
 }
 
-Size Sheet::GetPrintableSize() const {
-    return min_print_size_;
+std::vector<std::vector<size_t>> Sheet::GetOrderArguments(const std::vector<const Cell*>& order) const {
+    std::unordered_map<const Cell*, size_t> indices;
+    indices.reserve(order.size());
+    for(size_t i = 0; i < order.size(); ++i) {
+        indices.emplace(order[i], i);
+    }
+    std::vector<std::vector<size_t>> arguments(order.size());
+    for(size_t i = 0; i < order.size(); ++i) {
+        for(const Cell* arg : GetDirtyArguments(*order[i])) {
+            auto it = indices.find(arg);
+            if(it != indices.end()) {
+                arguments[i].push_back(it->second);
+            }
+        }
+    }
+    return arguments;
 }
 
-void Sheet::PrintValues(std::ostream& output) const {
-    for(int i = 0; i < min_print_size_.rows; ++i) {
-        for(int k = 0; k < min_print_size_.cols; ++k) {
-            if(cells_[i][k].get() != nullptr) {
-                if(std::holds_alternative<std::string>(cells_[i][k]->GetValue())) {
-                    output << std::get<std::string>(cells_[i][k]->GetValue());
-                }
-                if(std::holds_alternative<double>(cells_[i][k]->GetValue())) {
-                    output << std::get<double>(cells_[i][k]->GetValue());
+std::vector<const Cell*> Sheet::GetDirtyArguments(const Cell& cell) const {
+    std::vector<const Cell*> arguments;
+    for(Position pos : cell.GetCellReferences()) {
+        const Cell* arg = GetCellPtr(pos);
+        if(arg != nullptr && arg->IsDirty()) {
+            arguments.push_back(arg);
+        }
+    }
+    for(const CellRange& range : cell.GetRangeReferences()) {
+        for(const Cell* arg : GetCellsInRange(range)) {
+            if(arg->IsDirty()) {
+                arguments.push_back(arg);
+            }
+        }
+    }
+    return arguments;
+}
+
+void Sheet::SetRecalculationThreads(size_t thread_count) {
+    if(thread_count <= 1) {
+        thread_pool_.reset();
+    } else {
+        thread_pool_ = std::make_unique<ThreadPool>(thread_count);
+    }
+}
+
+void Sheet::BeginBatch() {
+    if(in_batch_) {
+        throw std::logic_error("Sheet::BeginBatch: batch is already started");
+    }
+    in_batch_ = true;
+}
+
+void Sheet::CommitBatch() {
+    if(!in_batch_) {
+        throw std::logic_error("Sheet::CommitBatch: batch is not started");
+    }
+    in_batch_ = false;
+    std::vector<std::pair<Position, std::string>> edits = std::move(batch_);
+    batch_.clear();
+
+    // из нескольких изменений одной ячейки действует последнее
+    std::unordered_map<Position, size_t, PositionHasher> last_edits;
+    for(size_t i = 0; i < edits.size(); ++i) {
+        last_edits[edits[i].first] = i;
+    }
+
+    std::vector<std::pair<Position, Cell::Content>> contents;
+    contents.reserve(last_edits.size());
+    for(size_t i = 0; i < edits.size(); ++i) {
+        if(last_edits.at(edits[i].first) == i) {
+            contents.emplace_back(edits[i].first, ParseCellText(std::move(edits[i].second), edits[i].first));
+        }
+    }
+    ApplyContents(std::move(contents));
+}
+
+void Sheet::ImportTexts(std::istream& input, char delimiter) {
+    if(in_batch_) {
+        throw std::logic_error("Sheet::ImportTexts: batch is started");
+    }
+
+    TextTableReader reader(input, delimiter);
+    std::vector<std::pair<Position, Cell::Content>> contents;
+    std::vector<std::string_view> rows;
+    std::vector<std::vector<std::pair<Position, Cell::Content>>> parsed_rows;
+    int first_row = 0;
+    while(reader.ReadChunk(rows)) {
+        // строки куска разбираются независимо, формулы - тоже
+        parsed_rows.clear();
+        parsed_rows.resize(rows.size());
+        auto parse_row = [&](size_t i) {
+            const int row = first_row + static_cast<int>(i);
+            reader.SplitRow(rows[i], [&](int col, std::string text) {
+                const Position pos{row, col};
+                if(!pos.IsValid()) {
+                    throw InvalidPositionException("Sheet::ImportTexts: out of range");
                 }
-                if(std::holds_alternative<FormulaError>(cells_[i][k]->GetValue())) {
-                    output << std::get<FormulaError>(cells_[i][k]->GetValue());
+                parsed_rows[i].emplace_back(pos, ParseCellText(std::move(text), pos));
+            });
+        };
+        if(thread_pool_) {
+            thread_pool_->ParallelFor(rows.size(), parse_row);
+        } else {
+            for(size_t i = 0; i < rows.size(); ++i) {
+                parse_row(i);
+            }
+        }
+
+        for(auto& parsed_row : parsed_rows) {
+            std::move(parsed_row.begin(), parsed_row.end(), std::back_inserter(contents));
+        }
+        first_row += static_cast<int>(rows.size());
+    }
+    ApplyContents(std::move(contents));
+}
+
+void Sheet::ApplyContents(std::vector<std::pair<Position, Cell::Content>> contents) {
+    std::unordered_map<Position, const Cell::Content*, PositionHasher> contents_by_pos;
+    for(const auto& [pos, content] : contents) {
+        contents_by_pos[pos] = &content;
+    }
+    CheckBatchCycles(contents_by_pos);
+
+    // Сначала у всех изменяемых ячеек убираются прежние ссылки, затем новые
+    // формулы добавляются по одной. Граф на каждом шаге - часть итогового,
+    // поэтому циклов в нём нет и топологический порядок поддерживается
+    // обычной вставкой.
+    std::vector<Cell*> edited;
+    std::vector<bool> was_empty;
+    edited.reserve(contents.size());
+    was_empty.reserve(contents.size());
+    for(const auto& [pos, content] : contents) {
+        Cell& cell = GetOrCreateCell(pos);
+        was_empty.push_back(cell.IsEmpty());
+        cell.Apply({});
+        edited.push_back(&cell);
+    }
+    for(size_t i = 0; i < contents.size(); ++i) {
+        auto& [pos, content] = contents[i];
+        if(content.formula) {
+            edited[i]->PlaceAfterReferences(*content.formula);
+        }
+        edited[i]->Apply(std::move(content));
+        UpdatePrintable(pos, was_empty[i], edited[i]->IsEmpty());
+    }
+
+    for(Cell* cell : edited) {
+        cell->InvalidateDependents();
+    }
+    if(journal_) {
+        for(size_t i = 0; i < contents.size(); ++i) {
+            journal_->Record(contents[i].first, edited[i]->GetText());
+        }
+        journal_->CommitIfFull();
+    }
+    for(const auto& [pos, content] : contents) {
+        EraseIfUnused(pos);
+    }
+}
+
+namespace {
+// Формат снимка, все числа в порядке байтов платформы:
+//   "SSNP", версия (uint32)
+//   число формул (uint32), двоичные формы формул (строки)
+//   число ячеек (uint64), записи ячеек:
+//     позиция, вид (uint8)
+//     текст: строка
+//     формула: номер формулы (uint32), тип значения (uint8), число (double)
+// Строки записываются WriteBinaryString().
+constexpr std::string_view SNAPSHOT_MAGIC = "SSNP";
+constexpr std::uint32_t SNAPSHOT_VERSION = 1;
+
+enum class SnapshotCellKind : std::uint8_t {
+    Text,
+    Formula,
+};
+
+// наименьшие записи: формула - длина пустой строки, ячейка - текст из
+// одного знака
+constexpr size_t MIN_SNAPSHOT_FORMULA_SIZE = sizeof(std::uint32_t);
+constexpr size_t MIN_SNAPSHOT_CELL_SIZE = sizeof(Position) + sizeof(SnapshotCellKind) + sizeof(std::uint32_t) + 1;
+
+std::string ReadAll(std::istream& input) {
+    constexpr size_t CHUNK_SIZE = 1 << 20;
+    std::string data;
+    while(input) {
+        const size_t size = data.size();
+        data.resize(size + CHUNK_SIZE);
+        input.read(data.data() + size, CHUNK_SIZE);
+        data.resize(size + static_cast<size_t>(input.gcount()));
+    }
+    return data;
+}
+
+[[noreturn]] void ThrowInvalidSnapshot() {
+    throw std::runtime_error("Sheet::LoadSnapshot: invalid snapshot");
+}
+
+// Ссылки формулы, перенесённой в ячейку, не выходят за пределы листа, а углы
+// диапазонов упорядочены, как после разбора текста
+bool HasValidReferences(const FormulaInterface& formula) {
+    for(Position pos : formula.GetCellReferences()) {
+        if(!pos.IsValid()) {
+            return false;
+        }
+    }
+    for(const CellRange& range : formula.GetRangeReferences()) {
+        if(!range.first.IsValid() || !range.last.IsValid() || range.first.row > range.last.row ||
+            range.first.col > range.last.col) {
+            return false;
+        }
+    }
+    return true;
+}
+}  // namespace
+
+void Sheet::SaveSnapshot(std::ostream& output) const {
+    std::vector<const Cell*> cells;
+    cells.reserve(cells_.GetCellCount());
+    for(Position pos : cells_.GetPositionsInRange({0, 0}, {Position::MAX_ROWS - 1, Position::MAX_COLS - 1})) {
+        const Cell* cell = cells_.Get(pos);
+        if(!cell->IsEmpty()) {
+            cells.push_back(cell);
+        }
+    }
+    std::sort(cells.begin(), cells.end(), [](const Cell* lhs, const Cell* rhs) {
+        return lhs->GetOrder() < rhs->GetOrder();
+    });
+
+    // копии формулы имеют одинаковую двоичную форму
+    std::unordered_map<std::string, std::uint32_t> formula_indices;
+    std::vector<const std::string*> formulas;
+    std::string records;
+    std::string formula_data;
+    for(const Cell* cell : cells) {
+        WriteBinary(records, cell->GetPosition());
+        const FormulaInterface* formula = cell->GetFormula();
+        if(formula == nullptr) {
+            WriteBinary(records, SnapshotCellKind::Text);
+            WriteBinaryString(records, cell->GetText());
+            continue;
+        }
+
+        formula_data.clear();
+        formula->Serialize(formula_data);
+        auto [it, inserted] = formula_indices.emplace(formula_data, formula_indices.size());
+        if(inserted) {
+            formulas.push_back(&it->first);
+        }
+        // устаревшее значение ручного режима не сохраняется
+        const NumericValue value = cell->IsDirty() ? NumericValue{NumericValue::Tag::Stale}
+                                                   : cells_.GetNumericValue(cell->GetPosition());
+        WriteBinary(records, SnapshotCellKind::Formula);
+        WriteBinary(records, it->second);
+        WriteBinary(records, value.tag);
+        WriteBinary(records, value.number);
+    }
+
+    std::string header;
+    header.append(SNAPSHOT_MAGIC);
+    WriteBinary(header, SNAPSHOT_VERSION);
+    WriteBinary(header, static_cast<std::uint32_t>(formulas.size()));
+    for(const std::string* data : formulas) {
+        WriteBinaryString(header, *data);
+    }
+    WriteBinary(header, static_cast<std::uint64_t>(cells.size()));
+    output.write(header.data(), static_cast<std::streamsize>(header.size()));
+    output.write(records.data(), static_cast<std::streamsize>(records.size()));
+}
+
+void Sheet::LoadSnapshot(std::istream& input) {
+    if(in_batch_ || cells_.GetCellCount() != 0) {
+        throw std::logic_error("Sheet::LoadSnapshot: sheet is not empty");
+    }
+
+    const std::string data = ReadAll(input);
+    BinaryReader reader(data);
+    try {
+        if(reader.ReadBytes(SNAPSHOT_MAGIC.size()) != SNAPSHOT_MAGIC ||
+            reader.Read<std::uint32_t>() != SNAPSHOT_VERSION) {
+            ThrowInvalidSnapshot();
+        }
+        // числа проверяются по размеру данных до выделения памяти
+        std::vector<std::string_view> formulas(reader.ReadCount<std::uint32_t>(MIN_SNAPSHOT_FORMULA_SIZE));
+        for(std::string_view& formula : formulas) {
+            formula = reader.ReadString();
+        }
+        // первая ячейка с формулой разбирает её двоичную форму, остальные
+        // получают копии с общей программой
+        std::vector<std::unique_ptr<FormulaInterface>> prototypes(formulas.size());
+
+        const size_t cell_count = reader.ReadCount<std::uint64_t>(MIN_SNAPSHOT_CELL_SIZE);
+        for(size_t i = 0; i < cell_count; ++i) {
+            const auto pos = reader.Read<Position>();
+            if(!pos.IsValid()) {
+                ThrowInvalidSnapshot();
+            }
+            Cell::Content content;
+            NumericValue value{NumericValue::Tag::Stale};
+            switch(reader.Read<SnapshotCellKind>()) {
+                case SnapshotCellKind::Text:
+                    content.text = reader.ReadString();
+                    if(content.text.empty() || (content.text[0] == FORMULA_SIGN && content.text.size() > 1)) {
+                        ThrowInvalidSnapshot();
+                    }
+                    break;
+                case SnapshotCellKind::Formula: {
+                    const auto index = reader.Read<std::uint32_t>();
+                    value.tag = reader.Read<NumericValue::Tag>();
+                    value.number = reader.Read<double>();
+                    if(index >= formulas.size() || value.tag < NumericValue::Tag::Number ||
+                        value.tag > NumericValue::Tag::ArithmeticError || value.tag == NumericValue::Tag::Text) {
+                        ThrowInvalidSnapshot();
+                    }
+                    if(!prototypes[index]) {
+                        prototypes[index] = LoadFormula(formulas[index], pos);
+                    }
+                    content.formula = prototypes[index]->CopyTo(pos);
+                    if(!HasValidReferences(*content.formula)) {
+                        ThrowInvalidSnapshot();
+                    }
+                    break;
                 }
+                default:
+                    ThrowInvalidSnapshot();
             }
-            if(k != min_print_size_.cols-1) {
-                output << '\t';
+
+            // ячейки идут в топологическом порядке: аргументы формулы уже
+            // загружены и вычислены, зависимых у неё ещё нет
+            Cell& cell = GetOrCreateCell(pos);
+            const bool was_empty = cell.IsEmpty();
+            if(content.formula) {
+                cell.PlaceAfterReferences(*content.formula);
             }
+            cell.Apply(std::move(content));
+            UpdatePrintable(pos, was_empty, cell.IsEmpty());
+            cell.RestoreValue(value);
+        }
+        if(!reader.AtEnd()) {
+            ThrowInvalidSnapshot();
         }
-        output << '\n';
+    } catch(...) {
+        EditJournal* journal = std::exchange(journal_, nullptr);
+        ClearRange({0, 0}, {Position::MAX_ROWS - 1, Position::MAX_COLS - 1});
+        journal_ = journal;
+        throw;
     }
-    
 }
-void Sheet::PrintTexts(std::ostream& output) const {
-    for(int i = 0; i < min_print_size_.rows; ++i) {
-        for(int k = 0; k < min_print_size_.cols; ++k) {
-            if(cells_[i][k].get() != nullptr) {
-                output << cells_[i][k]->GetText();
-            }
-            if(k != min_print_size_.cols-1) {
-                output << '\t';
+
+Cell::Content Sheet::ParseCellText(std::string text, Position pos) const {
+    if(text.size() <= 1 || text[0] != FORMULA_SIGN) {
+        return Cell::Parse(std::move(text), pos);
+    }
+    SheetCounters::Timer timer(counters_, SheetCounters::Latency::Parse);
+    counters_.Add(SheetCounters::Counter::FormulasParsed);
+    return Cell::Parse(std::move(text), pos);
+}
+
+SheetStats Sheet::GetStats() const {
+    return counters_.GetStats();
+}
+
+void Sheet::ResetStats() {
+    counters_.Reset();
+}
+
+SheetCounters& Sheet::GetCounters() const {
+    return counters_;
+}
+
+std::shared_ptr<const SheetVersion> Sheet::PublishVersion() {
+    if(calculation_mode_ == CalculationMode::Automatic) {
+        Recalculate();
+    } else {
+        // вычисление может добавить позиции в dirty_cells_
+        const std::vector<Position> dirty_cells = dirty_cells_;
+        for(Position pos : dirty_cells) {
+            const Cell* cell = GetCellPtr(pos);
+            if(cell != nullptr && !cell->HasValue()) {
+                RecalculateCell(*cell);
             }
         }
-        output << '\n';
     }
+
+    const std::shared_ptr<const SheetVersion> previous = GetVersion();
+    std::vector<std::pair<int, std::shared_ptr<const SheetVersion::Block>>> changes;
+    cells_.TakeChangedTiles([&changes](int key, const CellStorage::TileCells* cells) {
+        changes.emplace_back(key, cells ? SheetVersion::MakeBlock(*cells) : nullptr);
+    });
+    auto version = std::make_shared<const SheetVersion>(previous->GetNumber() + 1, GetPrintableSize(),
+                                                        previous->GetBlocks().With(std::move(changes)));
+    std::atomic_store(&version_, version);
+    return version;
 }
 
-std::unique_ptr<SheetInterface> CreateSheet() {
-    return std::make_unique<Sheet>();
+std::shared_ptr<const SheetVersion> Sheet::GetVersion() const {
+    return std::atomic_load(&version_);
+}
+
+void Sheet::SetTrace(RecalcTrace* trace) {
+    trace_ = trace;
+}
+
+RecalcTrace* Sheet::GetTrace() const {
+    return trace_;
+}
+
+void Sheet::SetJournal(EditJournal* journal) {
+    journal_ = journal;
 }
 
-void Sheet::Resize(Position pos) {
-    if(cells_.size() < static_cast<size_t>(pos.row+1)) {
-        size_t old_size = cells_.size();
-        cells_.resize(pos.row+1);
+EditJournal* Sheet::GetJournal() const {
+    return journal_;
+}
 
-        for(int i = old_size; i < static_cast<int>(cells_.size()); ++i) {
-            cells_[i].resize(cells_[0].size());
+void Sheet::SetCells(std::vector<std::pair<Position, std::string>> cells) {
+    for(const auto& [pos, text] : cells) {
+        if(!pos.IsValid()) {
+            throw InvalidPositionException("Sheet::SetCells: out of range");
         }
     }
 
-    if(min_print_size_.rows <= pos.row) {
-        min_print_size_.rows = pos.row + 1;
+    BeginBatch();
+    batch_ = std::move(cells);
+    CommitBatch();
+}
+
+void Sheet::CheckBatchCycles(
+    const std::unordered_map<Position, const Cell::Content*, PositionHasher>& contents) const {
+    SheetCounters::Timer timer(counters_, SheetCounters::Latency::CycleCheck);
+    // Алгоритм Тарьяна без рекурсии по графу, в котором изменённые ячейки
+    // уже имеют новое содержимое. Прежний граф ацикличен, поэтому обходить
+    // достаточно ячейки, достижимые из изменённых.
+    // изменённые позиции, упорядоченные по строкам, для поиска тех из
+    // них, что попадают в диапазоны
+    std::set<Position> edited;
+    for(const auto& [pos, content] : contents) {
+        edited.insert(pos);
     }
 
-    if(cells_[0].size() < static_cast<size_t>(pos.col + 1)) {
-        for(auto& col : cells_) {
-            col.resize(pos.col + 1);
+    // диапазон заменяется ячейками, которые в нём есть или появятся
+    auto add_range_cells = [&](const CellRange& range, std::vector<Position>& references) {
+        for(const Cell* cell : GetCellsInRange(range)) {
+            references.push_back(cell->GetPosition());
         }
+        auto it = edited.lower_bound(range.first);
+        while(it != edited.end() && it->row <= range.last.row) {
+            if(it->col < range.first.col) {
+                it = edited.lower_bound({it->row, range.first.col});
+            } else if(it->col > range.last.col) {
+                it = edited.lower_bound({it->row + 1, range.first.col});
+            } else {
+                if(cells_.Get(*it) == nullptr) {
+                    references.push_back(*it);
+                }
+                ++it;
+            }
+        }
+    };
+
+    auto get_references = [&](Position pos) {
+        std::vector<Position> references;
+        std::vector<CellRange> ranges;
+        auto it = contents.find(pos);
+        if(it != contents.end()) {
+            if(const auto& formula = it->second->formula) {
+                references = formula->GetCellReferences();
+                ranges = formula->GetRangeReferences();
+            }
+        } else if(const Cell* cell = GetCellPtr(pos)) {
+            references = cell->GetCellReferences();
+            ranges = cell->GetRangeReferences();
+        }
+        for(const CellRange& range : ranges) {
+            add_range_cells(range, references);
+        }
+        return references;
+    };
+
+    struct Node {
+        int index;
+        int lowlink;
+        bool on_stack;
+    };
+    struct Frame {
+        Position pos;
+        std::vector<Position> references;
+        size_t next = 0;
+    };
+
+    std::unordered_map<Position, Node, PositionHasher> nodes;
+    std::vector<Position> component_stack;
+    std::vector<Frame> frames;
+    std::vector<Position> cyclic_cells;
+    int next_index = 0;
+
+    auto visit = [&](Position pos) {
+        nodes[pos] = {next_index, next_index, true};
+        ++next_index;
+        component_stack.push_back(pos);
+        frames.push_back({pos, get_references(pos)});
+    };
+
+    for(const auto& [start, content] : contents) {
+        if(nodes.count(start)) {
+            continue;
+        }
+        visit(start);
+
+        while(!frames.empty()) {
+            Frame& frame = frames.back();
+            if(frame.next < frame.references.size()) {
+                const Position pos = frame.pos;
+                const Position ref = frame.references[frame.next++];
+                if(ref == pos) {
+                    cyclic_cells.push_back(pos);
+                }
+
+                auto it = nodes.find(ref);
+                if(it == nodes.end()) {
+                    visit(ref);
+                } else if(it->second.on_stack) {
+                    Node& node = nodes.at(pos);
+                    node.lowlink = std::min(node.lowlink, it->second.index);
+                }
+                continue;
+            }
+
+            const Position pos = frame.pos;
+            frames.pop_back();
+            Node& node = nodes.at(pos);
+            if(node.lowlink == node.index) {
+                std::vector<Position> component;
+                Position member;
+                do {
+                    member = component_stack.back();
+                    component_stack.pop_back();
+                    nodes.at(member).on_stack = false;
+                    component.push_back(member);
+                } while(!(member == pos));
+
+                if(component.size() > 1) {
+                    cyclic_cells.insert(cyclic_cells.end(), component.begin(), component.end());
+                }
+            }
+            if(!frames.empty()) {
+                Node& parent = nodes.at(frames.back().pos);
+                parent.lowlink = std::min(parent.lowlink, node.lowlink);
+            }
+        }
+    }
+
+    if(cyclic_cells.empty()) {
+        return;
     }
 
-    if(min_print_size_.cols <= pos.col) {
-        min_print_size_.cols = pos.col + 1;
+    std::sort(cyclic_cells.begin(), cyclic_cells.end());
+    cyclic_cells.erase(std::unique(cyclic_cells.begin(), cyclic_cells.end()), cyclic_cells.end());
+    std::string message = "Circular Dependency:";
+    for(Position pos : cyclic_cells) {
+        message += ' ' + pos.ToString();
     }
+    throw CircularDependencyException(message);
+}
+
+std::unique_ptr<SheetInterface> CreateSheet() {
+    return std::make_unique<Sheet>();
 }
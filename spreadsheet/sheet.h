@@ -1,30 +1,198 @@
 #pragma once
 
 #include "cell.h"
+#include "cell_storage.h"
 #include "common.h"
+#include "range_index.h"
+#include "sheet_stats.h"
+#include "sheet_version.h"
+#include "thread_pool.h"
 
 #include <functional>
+#include <memory>
+#include <unordered_map>
+#include <utility>
+
+class EditJournal;
+class RecalcTrace;
+
+// Режим пересчёта формул
+enum class CalculationMode {
+    // значение формулы, зависящей от изменённых ячеек, пересчитывается при
+    // первом чтении
+    Automatic,
+    // изменения только помечают зависимые формулы устаревшими, чтение
+    // возвращает последнее вычисленное значение, Cell::IsDirty() сообщает,
+    // что оно устарело; пересчитывает Sheet::Recalculate()
+    Manual,
+};
 
 class Sheet : public SheetInterface {
 public:
-    using CellsMatrix = std::vector<std::vector<std::unique_ptr<CellInterface>>>;
-
     ~Sheet() = default;
 
     void SetCell(Position pos, std::string text) override;
 
     const CellInterface* GetCell(Position pos) const override;
     CellInterface* GetCell(Position pos) override;
-    std::unique_ptr<CellInterface>& GetUniqPtrCell(Position pos);
+    // Возвращает ячейку, создавая пустую, если её ещё нет
+    Cell& GetOrCreateCell(Position pos);
+    // Ячейка pos или nullptr, если её нет или позиция некорректна
+    Cell* GetCellPtr(Position pos) const;
 
     void ClearCell(Position pos) override;
+    // Очищает все ячейки прямоугольника с углами first и last включительно
+    void ClearRange(Position first, Position last);
+
+    // Существующие ячейки прямоугольника
+    std::vector<Cell*> GetCellsInRange(const CellRange& range) const;
+    // Зависимости формул от диапазонов, см. RangeIndex
+    void AddRangeDependent(const CellRange& range, Cell* dependent);
+    void RemoveRangeDependent(const CellRange& range, Cell* dependent);
+    // Добавляет в result формулы, ссылающиеся на диапазоны, которые содержат pos
+    void GetRangeDependents(Position pos, std::vector<Cell*>& result) const;
+
+    // Обновляет значение ячейки для формул в хранилище
+    void SetNumericValue(Position pos, NumericValue value);
+
+    // Номера мест в начале и в конце топологического порядка ячеек
+    std::int64_t PrependToOrder();
+    std::int64_t AppendToOrder();
 
     Size GetPrintableSize() const override;
-    void Resize(Position);
 
     void PrintValues(std::ostream& output) const override;
     void PrintTexts(std::ostream& output) const override;
+
+    double GetCellNumber(Position pos) const override;
+    void GatherRangeValues(
+        Position first, Position last,
+        const std::function<void(const double* values, size_t count)>& consumer) const override;
+
+    // Пересчитывает все устаревшие формулы, каждую ровно один раз, в порядке
+    // зависимостей
+    void Recalculate();
+    // То же для устаревших формул прямоугольника с углами first и last
+    // включительно и устаревших ячеек, от которых они зависят. Углы
+    // проверяются, как в ClearRange()
+    void Recalculate(Position first, Position last);
+    // Пересчитывает устаревшую формулу вместе с устаревшими ячейками, от
+    // которых она зависит. В ручном режиме вычисляются только формулы без
+    // значения, остальные аргументы берутся с прежними значениями.
+    void RecalculateCell(const Cell& cell);
+    void AddDirtyCell(Position pos);
+
+    // Задаёт число потоков для пересчёта и загрузки. Формулы одного уровня
+    // графа зависимостей (все аргументы которых уже вычислены)
+    // пересчитываются параллельно; результат совпадает с последовательным
+    // пересчётом. Значение 0 или 1 включает последовательную обработку.
+    void SetRecalculationThreads(size_t thread_count);
+
+    // Переключение в автоматический режим пересчитывает все устаревшие формулы
+    void SetCalculationMode(CalculationMode mode);
+    CalculationMode GetCalculationMode() const;
+
+    // Пакетное редактирование. Между BeginBatch() и CommitBatch() вызовы
+    // SetCell() и ClearCell() только запоминаются, а GetCell() возвращает
+    // ячейки в прежнем состоянии. CommitBatch() разбирает все формулы, один
+    // раз проверяет граф на циклы и один раз помечает устаревшими зависимые
+    // ячейки. Если какая-то формула некорректна или образует цикл, бросается
+    // FormulaException или CircularDependencyException (со списком всех ячеек
+    // циклов), пакет отменяется и таблица не изменяется.
+    void BeginBatch();
+    void CommitBatch();
+    // Устанавливает содержимое нескольких ячеек одним пакетом
+    void SetCells(std::vector<std::pair<Position, std::string>> cells);
+    // Загружает ячейки из текста в формате PrintTexts (формат описан в
+    // TextTableReader) одним пакетом. Строки разбираются параллельно
+    // потоками, заданными SetRecalculationThreads(). Пустые ячейки текста
+    // не меняют таблицу. При ошибке бросается исключение, как в
+    // CommitBatch(), и таблица не изменяется.
+    void ImportTexts(std::istream& input, char delimiter = '\t');
+
+    // Двоичный снимок таблицы: содержимое ячеек, формулы в скомпилированной
+    // форме (каждая общая форма один раз) и вычисленные значения формул.
+    // Ячейки записываются в топологическом порядке, поэтому при загрузке
+    // связи и порядок восстанавливаются за один проход без разбора текста
+    // и без пересчёта. Формат зависит от порядка байтов платформы.
+    void SaveSnapshot(std::ostream& output) const;
+    // Загружает снимок в пустую таблицу. Если снимок повреждён, бросается
+    // std::runtime_error или FormulaException и таблица остаётся пустой.
+    void LoadSnapshot(std::istream& input);
+
+    // Разбирает текст ячейки, см. Cell::Parse, с учётом в счётчиках
+    Cell::Content ParseCellText(std::string text, Position pos) const;
+
+    // Счётчики и гистограммы длительностей работы таблицы с момента
+    // создания или последнего ResetStats()
+    SheetStats GetStats() const;
+    void ResetStats();
+    SheetCounters& GetCounters() const;
+
+    // Публикует текущее состояние таблицы как новую версию: в
+    // автоматическом режиме сначала пересчитывает устаревшие формулы, в
+    // ручном - вычисляет только формулы без значения. Блоки плиток, не
+    // изменившихся с прошлой публикации, общие с прошлой версией.
+    // Как и остальные изменения, вызывается только из потока-писателя.
+    std::shared_ptr<const SheetVersion> PublishVersion();
+    // Последняя опубликованная версия (до первой публикации - пустая).
+    // Можно вызывать из любых потоков одновременно с изменениями таблицы.
+    // Указатель читается через std::atomic_load, который в распространённых
+    // реализациях (libstdc++, libc++) не свободен от блокировок: вызов
+    // ненадолго берёт мьютекс из общего пула. Чтение самой полученной
+    // версии блокировок не требует, поэтому читателю выгодно держать версию
+    // на время серии запросов, а не вызывать GetVersion() на каждый.
+    std::shared_ptr<const SheetVersion> GetVersion() const;
+
+    // Подключает журнал изменений (nullptr отключает). Журнал записывает
+    // каждое применённое изменение ячейки, загрузка снимка не записывается.
+    // Журнал должен жить, пока подключён.
+    void SetJournal(EditJournal* journal);
+    EditJournal* GetJournal() const;
+
+    // Подключает трассу пересчёта (nullptr отключает): время вычисления
+    // каждой формулы, её уровень в графе пересчёта и число прочитанных
+    // ячеек. Без трассы пересчёт не замеряется. Трасса должна жить, пока
+    // подключена.
+    void SetTrace(RecalcTrace* trace);
+    RecalcTrace* GetTrace() const;
+
 private:
-    CellsMatrix cells_;
-    Size min_print_size_{0,0};
+    CellStorage cells_;
+    RangeIndex range_dependents_;
+    // границы занятых номеров топологического порядка
+    std::int64_t first_order_ = 0;
+    std::int64_t last_order_ = 0;
+    // ячейки с непустым текстом, определяют печатаемую область
+    OccupancyIndex printable_cells_;
+    // позиции ячеек, помеченных устаревшими; могут содержать уже
+    // пересчитанные или удалённые ячейки
+    std::vector<Position> dirty_cells_;
+    size_t dirty_cells_limit_ = 1024;
+    bool in_batch_ = false;
+    std::vector<std::pair<Position, std::string>> batch_;
+    std::unique_ptr<ThreadPool> thread_pool_;
+    EditJournal* journal_ = nullptr;
+    RecalcTrace* trace_ = nullptr;
+    CalculationMode calculation_mode_ = CalculationMode::Automatic;
+    // читается и заменяется только через std::atomic_load и std::atomic_store,
+    // см. GetVersion()
+    std::shared_ptr<const SheetVersion> version_ = std::make_shared<const SheetVersion>();
+    mutable SheetCounters counters_;
+
+    void ClearCellContent(Cell& cell);
+    void EraseIfUnused(Position pos);
+    void UpdatePrintable(Position pos, bool was_empty, bool is_empty);
+    // Устанавливает разобранное содержимое ячеек с различными позициями:
+    // проверяет циклы, перестраивает связи и помечает зависимые ячейки
+    void ApplyContents(std::vector<std::pair<Position, Cell::Content>> contents);
+    void CheckBatchCycles(
+        const std::unordered_map<Position, const Cell::Content*, PositionHasher>& contents) const;
+    // keep_stale: вычислить только формулы без значения по прежним значениям
+    // устаревших аргументов (ручной режим)
+    void RecalculateCells(const std::vector<const Cell*>& cells, bool keep_stale = false);
+    // Номера в order устаревших аргументов каждой ячейки order
+    std::vector<std::vector<size_t>> GetOrderArguments(const std::vector<const Cell*>& order) const;
+    // Устаревшие ячейки, от которых зависит формула ячейки
+    std::vector<const Cell*> GetDirtyArguments(const Cell& cell) const;
 };
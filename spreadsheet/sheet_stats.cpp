@@ -0,0 +1,75 @@
+#include "sheet_stats.h"
+
+#include <algorithm>
+
+std::uint64_t LatencyHistogram::GetQuantileNs(double q) const {
+    if(count == 0) {
+        return 0;
+    }
+    const auto rank = static_cast<std::uint64_t>(std::clamp(q, 0.0, 1.0) * (count - 1));
+    std::uint64_t seen = 0;
+    for(size_t i = 0; i < BUCKET_COUNT; ++i) {
+        seen += buckets[i];
+        if(seen > rank) {
+            return (std::uint64_t{2} << i) - 1;
+        }
+    }
+    return (std::uint64_t{2} << (BUCKET_COUNT - 1)) - 1;
+}
+
+void SheetCounters::Record(Latency latency, std::chrono::steady_clock::duration duration) {
+#if SPREADSHEET_STATS
+    const auto ns = static_cast<std::uint64_t>(
+        std::max<std::int64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count(), 0));
+    size_t bucket = 0;
+    while(bucket + 1 < LatencyHistogram::BUCKET_COUNT && (ns >> (bucket + 1)) != 0) {
+        ++bucket;
+    }
+    Histogram& histogram = histograms_[static_cast<size_t>(latency)];
+    histogram.count.fetch_add(1, std::memory_order_relaxed);
+    histogram.total_ns.fetch_add(ns, std::memory_order_relaxed);
+    histogram.buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+#endif
+}
+
+SheetStats SheetCounters::GetStats() const {
+    auto counter = [this](Counter counter) {
+        return counters_[static_cast<size_t>(counter)].load(std::memory_order_relaxed);
+    };
+    auto histogram = [this](Latency latency) {
+        const Histogram& source = histograms_[static_cast<size_t>(latency)];
+        LatencyHistogram result;
+        result.count = source.count.load(std::memory_order_relaxed);
+        result.total_ns = source.total_ns.load(std::memory_order_relaxed);
+        for(size_t i = 0; i < LatencyHistogram::BUCKET_COUNT; ++i) {
+            result.buckets[i] = source.buckets[i].load(std::memory_order_relaxed);
+        }
+        return result;
+    };
+
+    SheetStats stats;
+    stats.formulas_parsed = counter(Counter::FormulasParsed);
+    stats.value_cache_hits = counter(Counter::ValueCacheHits);
+    stats.value_cache_misses = counter(Counter::ValueCacheMisses);
+    stats.formulas_evaluated = counter(Counter::FormulasEvaluated);
+    stats.cells_invalidated = counter(Counter::CellsInvalidated);
+    stats.parse = histogram(Latency::Parse);
+    stats.evaluate = histogram(Latency::Evaluate);
+    stats.invalidate = histogram(Latency::Invalidate);
+    stats.cycle_check = histogram(Latency::CycleCheck);
+    stats.print = histogram(Latency::Print);
+    return stats;
+}
+
+void SheetCounters::Reset() {
+    for(auto& counter : counters_) {
+        counter.store(0, std::memory_order_relaxed);
+    }
+    for(Histogram& histogram : histograms_) {
+        histogram.count.store(0, std::memory_order_relaxed);
+        histogram.total_ns.store(0, std::memory_order_relaxed);
+        for(auto& bucket : histogram.buckets) {
+            bucket.store(0, std::memory_order_relaxed);
+        }
+    }
+}
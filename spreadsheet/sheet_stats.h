@@ -0,0 +1,121 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+// Счётчики работы таблицы включены по умолчанию; SPREADSHEET_STATS=0
+// убирает их при сборке, GetStats() тогда возвращает нули
+#ifndef SPREADSHEET_STATS
+#define SPREADSHEET_STATS 1
+#endif
+
+// Гистограмма длительностей: в корзину i попадают длительности из
+// [2^i, 2^(i+1)) наносекунд, в корзину 0 - также нулевые
+struct LatencyHistogram {
+    static constexpr size_t BUCKET_COUNT = 40;
+
+    std::uint64_t count = 0;
+    std::uint64_t total_ns = 0;
+    std::array<std::uint64_t, BUCKET_COUNT> buckets{};
+
+    // Оценка сверху для квантиля q из [0, 1]: верхняя граница корзины, в
+    // которую он попадает; 0 для пустой гистограммы
+    std::uint64_t GetQuantileNs(double q) const;
+};
+
+// Снимок счётчиков таблицы
+struct SheetStats {
+    // формулы, разобранные из текста
+    std::uint64_t formulas_parsed = 0;
+    // обращения к значениям формул через ячейку: готовое значение или
+    // пересчёт устаревшей формулы
+    std::uint64_t value_cache_hits = 0;
+    std::uint64_t value_cache_misses = 0;
+    std::uint64_t formulas_evaluated = 0;
+    // ячейки, помеченные устаревшими при изменениях
+    std::uint64_t cells_invalidated = 0;
+
+    // разбор одной формулы
+    LatencyHistogram parse;
+    // пересчёт группы устаревших формул
+    LatencyHistogram evaluate;
+    // пометка зависимых ячеек после одного изменения
+    LatencyHistogram invalidate;
+    // проверка циклов для одной формулы или пакета
+    LatencyHistogram cycle_check;
+    // PrintValues и PrintTexts
+    LatencyHistogram print;
+};
+
+// Счётчики, которые таблица обновляет по ходу работы. Обновления - атомарные
+// операции с ослабленным порядком, их можно выполнять из разных потоков.
+class SheetCounters {
+public:
+    enum class Counter {
+        FormulasParsed,
+        ValueCacheHits,
+        ValueCacheMisses,
+        FormulasEvaluated,
+        CellsInvalidated,
+        COUNT,
+    };
+
+    enum class Latency {
+        Parse,
+        Evaluate,
+        Invalidate,
+        CycleCheck,
+        Print,
+        COUNT,
+    };
+
+    // Замеряет длительность от создания до разрушения
+    class Timer {
+    public:
+        Timer(SheetCounters& counters, Latency latency)
+#if SPREADSHEET_STATS
+            : counters_{counters}, latency_{latency}, start_{std::chrono::steady_clock::now()}
+#endif
+        {
+        }
+        Timer(const Timer&) = delete;
+        Timer& operator=(const Timer&) = delete;
+
+        ~Timer() {
+#if SPREADSHEET_STATS
+            counters_.Record(latency_, std::chrono::steady_clock::now() - start_);
+#endif
+        }
+
+#if SPREADSHEET_STATS
+    private:
+        SheetCounters& counters_;
+        Latency latency_;
+        std::chrono::steady_clock::time_point start_;
+#endif
+    };
+
+    void Add(Counter counter, std::uint64_t value = 1) {
+#if SPREADSHEET_STATS
+        counters_[static_cast<size_t>(counter)].fetch_add(value, std::memory_order_relaxed);
+#endif
+    }
+
+    void Record(Latency latency, std::chrono::steady_clock::duration duration);
+
+    SheetStats GetStats() const;
+    void Reset();
+
+private:
+    struct Histogram {
+        std::atomic<std::uint64_t> count{0};
+        std::atomic<std::uint64_t> total_ns{0};
+        std::array<std::atomic<std::uint64_t>, LatencyHistogram::BUCKET_COUNT> buckets{};
+    };
+
+    std::array<std::atomic<std::uint64_t>, static_cast<size_t>(Counter::COUNT)> counters_{};
+    std::array<Histogram, static_cast<size_t>(Latency::COUNT)> histograms_;
+};
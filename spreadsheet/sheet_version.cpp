@@ -0,0 +1,160 @@
+#include "sheet_version.h"
+
+#include "cell.h"
+#include "output_buffer.h"
+
+#include <algorithm>
+#include <string_view>
+#include <utility>
+#include <variant>
+
+namespace {
+// Значение текста ячейки без экранирующего символа
+std::string_view GetTextValue(std::string_view text) {
+    if(!text.empty() && text[0] == ESCAPE_SIGN) {
+        text.remove_prefix(1);
+    }
+    return text;
+}
+
+template <typename WriteCell>
+void PrintTable(std::ostream& output, Size size, const SheetVersion& version, WriteCell write_cell) {
+    OutputBuffer buffer(output);
+    for(int i = 0; i < size.rows; ++i) {
+        for(int k = 0; k < size.cols; ++k) {
+            if(const SheetVersion::CellData* cell = version.GetCell({i, k})) {
+                write_cell(*cell, buffer);
+            }
+            if(k != size.cols-1) {
+                buffer.Write('\t');
+            }
+        }
+        buffer.Write('\n');
+    }
+    buffer.Flush();
+}
+}  // namespace
+
+const SheetVersion::Block* SheetVersion::BlockTable::Get(int key) const {
+    const std::shared_ptr<const Chunk>& chunk = chunks_[key / CHUNK_SIZE];
+    return chunk ? (*chunk)[key % CHUNK_SIZE].get() : nullptr;
+}
+
+SheetVersion::BlockTable SheetVersion::BlockTable::With(
+    std::vector<std::pair<int, std::shared_ptr<const Block>>> changes) const {
+    std::sort(changes.begin(), changes.end(), [](const auto& lhs, const auto& rhs) {
+        return lhs.first < rhs.first;
+    });
+    BlockTable result = *this;
+    // каждый затронутый кусок копируется один раз
+    for(size_t i = 0; i < changes.size();) {
+        const size_t chunk_index = changes[i].first / CHUNK_SIZE;
+        auto chunk = chunks_[chunk_index] ? std::make_shared<Chunk>(*chunks_[chunk_index])
+                                          : std::make_shared<Chunk>();
+        for(; i < changes.size() && changes[i].first / CHUNK_SIZE == chunk_index; ++i) {
+            (*chunk)[changes[i].first % CHUNK_SIZE] = std::move(changes[i].second);
+        }
+        const bool empty = std::all_of(chunk->begin(), chunk->end(), [](const auto& block) {
+            return block == nullptr;
+        });
+        result.chunks_[chunk_index] = empty ? nullptr : std::move(chunk);
+    }
+    return result;
+}
+
+SheetVersion::SheetVersion(std::uint64_t number, Size printable_size, BlockTable blocks)
+    : number_{number}, printable_size_{printable_size}, blocks_{std::move(blocks)} {
+}
+
+std::shared_ptr<const SheetVersion::Block> SheetVersion::MakeBlock(const CellStorage::TileCells& cells) {
+    auto block = std::make_shared<Block>();
+    block->indices.fill(Block::NO_CELL);
+    for(size_t i = 0; i < cells.size(); ++i) {
+        const Cell* cell = cells[i];
+        if(cell == nullptr) {
+            continue;
+        }
+        CellData data{cell->GetText(), std::nullopt, cell->IsDirty()};
+        if(cell->GetFormula() != nullptr) {
+            const Cell::ValueView value = cell->GetValueView();
+            if(const double* number = std::get_if<double>(&value)) {
+                data.formula_value = *number;
+            } else {
+                data.formula_value = std::get<FormulaError>(value);
+            }
+        }
+        block->indices[i] = static_cast<std::int16_t>(block->cells.size());
+        block->cells.push_back(std::move(data));
+    }
+    return block;
+}
+
+std::uint64_t SheetVersion::GetNumber() const {
+    return number_;
+}
+
+Size SheetVersion::GetPrintableSize() const {
+    return printable_size_;
+}
+
+const SheetVersion::BlockTable& SheetVersion::GetBlocks() const {
+    return blocks_;
+}
+
+const SheetVersion::CellData* SheetVersion::GetCell(Position pos) const {
+    if(!pos.IsValid()) {
+        throw InvalidPositionException("SheetVersion::GetCell: out of range");
+    }
+    return FindCell(pos);
+}
+
+CellInterface::Value SheetVersion::GetValue(Position pos) const {
+    const CellData* cell = GetCell(pos);
+    if(cell == nullptr) {
+        return std::string{};
+    }
+    if(!cell->formula_value) {
+        return std::string(GetTextValue(cell->text));
+    }
+    if(const double* number = std::get_if<double>(&*cell->formula_value)) {
+        return *number;
+    }
+    return std::get<FormulaError>(*cell->formula_value);
+}
+
+std::string SheetVersion::GetText(Position pos) const {
+    const CellData* cell = GetCell(pos);
+    return cell ? cell->text : std::string{};
+}
+
+bool SheetVersion::IsStale(Position pos) const {
+    const CellData* cell = GetCell(pos);
+    return cell != nullptr && cell->stale;
+}
+
+void SheetVersion::PrintValues(std::ostream& output) const {
+    PrintTable(output, printable_size_, *this, [](const CellData& cell, OutputBuffer& buffer) {
+        if(!cell.formula_value) {
+            buffer.Write(GetTextValue(cell.text));
+        } else if(const double* number = std::get_if<double>(&*cell.formula_value)) {
+            buffer.Write(*number);
+        } else {
+            buffer.Write(std::get<FormulaError>(*cell.formula_value).ToString());
+        }
+    });
+}
+
+void SheetVersion::PrintTexts(std::ostream& output) const {
+    PrintTable(output, printable_size_, *this, [](const CellData& cell, OutputBuffer& buffer) {
+        buffer.Write(cell.text);
+    });
+}
+
+const SheetVersion::CellData* SheetVersion::FindCell(Position pos) const {
+    const Block* block = blocks_.Get(CellStorage::GetTileKey(pos));
+    if(block == nullptr) {
+        return nullptr;
+    }
+    const std::int16_t index = block->indices[CellStorage::GetIndexInTile(pos)];
+    return index == Block::NO_CELL ? nullptr : &block->cells[index];
+}
@@ -0,0 +1,94 @@
+#pragma once
+
+#include "cell_storage.h"
+#include "common.h"
+#include "formula.h"
+
+#include <array>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <ostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Неизменяемое состояние таблицы, опубликованное Sheet::PublishVersion():
+// тексты и вычисленные значения ячеек. Ячейки хранятся блоками по плиткам
+// хранилища; новая версия получает копии только изменившихся плиток, а
+// блоки остальных делит с предыдущей. Все методы можно вызывать из любых
+// потоков без блокировок, пока версия удерживается через shared_ptr
+// (получение версии через Sheet::GetVersion() блокировку берёт, см. там).
+class SheetVersion {
+public:
+    struct CellData {
+        std::string text;
+        // значение формулы; значение текста получается из text
+        std::optional<FormulaInterface::Value> formula_value;
+        // значение формулы устарело (ручной режим пересчёта)
+        bool stale = false;
+    };
+
+    // Ячейки одной плитки
+    struct Block {
+        static constexpr std::int16_t NO_CELL = -1;
+
+        // номер ячейки в cells для каждого места плитки или NO_CELL
+        std::array<std::int16_t, CellStorage::TILE_ROWS * CellStorage::TILE_COLS> indices;
+        std::vector<CellData> cells;
+    };
+
+    // Блоки по номерам плиток (CellStorage::GetTileKey). Таблица двухуровневая:
+    // номера разбиты на куски по CHUNK_SIZE, куски общие между версиями.
+    // Новая таблица копирует верхний уровень и изменённые куски, поэтому
+    // публикация стоит O(CHUNK_COUNT + CHUNK_SIZE * изменённые куски) и не
+    // зависит от общего числа плиток.
+    class BlockTable {
+    public:
+        static constexpr size_t TILE_COUNT = static_cast<size_t>(Position::MAX_ROWS / CellStorage::TILE_ROWS) *
+                                             (Position::MAX_COLS / CellStorage::TILE_COLS);
+        static constexpr size_t CHUNK_SIZE = 512;
+        static constexpr size_t CHUNK_COUNT = TILE_COUNT / CHUNK_SIZE;
+
+        // Блок плитки key или nullptr
+        const Block* Get(int key) const;
+        // Таблица с заменёнными блоками; nullptr удаляет блок плитки
+        BlockTable With(std::vector<std::pair<int, std::shared_ptr<const Block>>> changes) const;
+
+    private:
+        using Chunk = std::array<std::shared_ptr<const Block>, CHUNK_SIZE>;
+
+        std::array<std::shared_ptr<const Chunk>, CHUNK_COUNT> chunks_;
+    };
+
+    // Пустая версия с номером 0
+    SheetVersion() = default;
+    SheetVersion(std::uint64_t number, Size printable_size, BlockTable blocks);
+
+    // Копирует ячейки плитки хранилища. Значения формул должны быть вычислены.
+    static std::shared_ptr<const Block> MakeBlock(const CellStorage::TileCells& cells);
+
+    // Номер версии, растёт с каждой публикацией
+    std::uint64_t GetNumber() const;
+    Size GetPrintableSize() const;
+    const BlockTable& GetBlocks() const;
+
+    // Ячейка pos или nullptr, если её нет. Для некорректной позиции
+    // бросается InvalidPositionException.
+    const CellData* GetCell(Position pos) const;
+    // Значение и текст ячейки, как CellInterface; отсутствующая ячейка пуста
+    CellInterface::Value GetValue(Position pos) const;
+    std::string GetText(Position pos) const;
+    bool IsStale(Position pos) const;
+
+    // Печать в формате Sheet::PrintValues() и Sheet::PrintTexts()
+    void PrintValues(std::ostream& output) const;
+    void PrintTexts(std::ostream& output) const;
+
+private:
+    std::uint64_t number_ = 0;
+    Size printable_size_;
+    BlockTable blocks_;
+
+    const CellData* FindCell(Position pos) const;
+};
@@ -0,0 +1,88 @@
+#include "text_table_reader.h"
+
+#include <algorithm>
+
+TextTableReader::TextTableReader(std::istream& input, char delimiter, size_t chunk_size)
+    : input_{input}, delimiter_{delimiter}, quoted_{delimiter == ','},
+      chunk_size_{std::max<size_t>(chunk_size, 1)} {
+}
+
+bool TextTableReader::ReadChunk(std::vector<std::string_view>& rows) {
+    rows.clear();
+    // незаконченная строка прошлого куска переносится в начало буфера
+    buffer_.erase(0, begin_);
+    begin_ = 0;
+
+    size_t rows_end = std::string::npos;
+    while(rows_end == std::string::npos && input_) {
+        const size_t size = buffer_.size();
+        buffer_.resize(size + chunk_size_);
+        input_.read(buffer_.data() + size, static_cast<std::streamsize>(chunk_size_));
+        buffer_.resize(size + static_cast<size_t>(input_.gcount()));
+        rows_end = FindRowsEnd();
+    }
+    if(rows_end == std::string::npos) {
+        // поток закончился, остаток - последняя строка без перевода строки
+        if(buffer_.empty()) {
+            return false;
+        }
+        rows_end = buffer_.size();
+    }
+
+    std::string_view text(buffer_.data(), rows_end);
+    bool in_quotes = false;
+    size_t row_begin = 0;
+    for(size_t i = 0; i < text.size(); ++i) {
+        if(quoted_ && text[i] == '"') {
+            in_quotes = !in_quotes;
+        } else if(text[i] == '\n' && !in_quotes) {
+            rows.push_back(text.substr(row_begin, i - row_begin));
+            row_begin = i + 1;
+        }
+    }
+    if(row_begin < text.size()) {
+        rows.push_back(text.substr(row_begin));
+    }
+    begin_ = rows_end;
+    return true;
+}
+
+size_t TextTableReader::FindRowsEnd() const {
+    if(!quoted_) {
+        const size_t end = buffer_.rfind('\n');
+        return end == std::string::npos ? std::string::npos : end + 1;
+    }
+    // перевод строки внутри кавычек не заканчивает строку, поэтому кавычки
+    // считаются с начала буфера
+    bool in_quotes = false;
+    size_t result = std::string::npos;
+    for(size_t i = 0; i < buffer_.size(); ++i) {
+        if(buffer_[i] == '"') {
+            in_quotes = !in_quotes;
+        } else if(buffer_[i] == '\n' && !in_quotes) {
+            result = i + 1;
+        }
+    }
+    return result;
+}
+
+std::string TextTableReader::UnquoteField(std::string_view row, size_t& pos) const {
+    std::string text;
+    ++pos;
+    while(pos < row.size()) {
+        if(row[pos] != '"') {
+            text += row[pos++];
+        } else if(pos + 1 < row.size() && row[pos + 1] == '"') {
+            text += '"';
+            pos += 2;
+        } else {
+            ++pos;
+            break;
+        }
+    }
+    // текст после закрывающей кавычки до разделителя добавляется как есть
+    const size_t end = std::min(row.find(delimiter_, pos), row.size());
+    text.append(row.substr(pos, end - pos));
+    pos = end;
+    return text;
+}
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <cstddef>
+#include <istream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Чтение таблицы в текстовом виде: строки разделены переводом строки,
+// ячейки - разделителем. Так печатает таблицу Sheet::PrintTexts с
+// разделителем '\t'. Для разделителя ',' поддерживаются кавычки по
+// RFC 4180: ячейка в кавычках может содержать разделители и переводы
+// строк, кавычка внутри неё записывается двумя кавычками.
+// Поток читается кусками, каждый кусок содержит только целые строки.
+class TextTableReader {
+public:
+    static constexpr size_t CHUNK_SIZE = 4 * 1024 * 1024;
+
+    TextTableReader(std::istream& input, char delimiter, size_t chunk_size = CHUNK_SIZE);
+
+    // Читает очередной кусок, rows заполняется целыми строками без
+    // перевода строки. Строки действительны до следующего вызова.
+    // Возвращает false, когда поток закончился.
+    bool ReadChunk(std::vector<std::string_view>& rows);
+
+    // Разбивает строку на ячейки и вызывает func(column, text) для каждой
+    // непустой ячейки
+    template <typename Func>
+    void SplitRow(std::string_view row, Func func) const;
+
+private:
+    // Позиция после последнего конца строки вне кавычек в buffer_ или npos
+    size_t FindRowsEnd() const;
+    std::string UnquoteField(std::string_view row, size_t& pos) const;
+
+    std::istream& input_;
+    const char delimiter_;
+    const bool quoted_;
+    const size_t chunk_size_;
+    std::string buffer_;
+    // начало непрочитанной части buffer_
+    size_t begin_ = 0;
+};
+
+template <typename Func>
+void TextTableReader::SplitRow(std::string_view row, Func func) const {
+    if(!row.empty() && row.back() == '\r') {
+        row.remove_suffix(1);
+    }
+    size_t pos = 0;
+    for(int column = 0; pos <= row.size(); ++column) {
+        if(quoted_ && pos < row.size() && row[pos] == '"') {
+            std::string text = UnquoteField(row, pos);
+            if(!text.empty()) {
+                func(column, std::move(text));
+            }
+        } else {
+            size_t end = row.find(delimiter_, pos);
+            if(end == std::string_view::npos) {
+                end = row.size();
+            }
+            if(end > pos) {
+                func(column, std::string(row.substr(pos, end - pos)));
+            }
+            pos = end;
+        }
+        // pos стоит на разделителе или в конце строки
+        ++pos;
+    }
+}
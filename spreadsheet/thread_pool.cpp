@@ -0,0 +1,102 @@
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <utility>
+
+ThreadPool::ThreadPool(size_t thread_count) {
+    for(size_t i = 1; i < thread_count; ++i) {
+        workers_.emplace_back([this] {
+            WorkerLoop();
+        });
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard lock(mutex_);
+        stop_ = true;
+    }
+    start_cv_.notify_all();
+    for(std::thread& worker : workers_) {
+        worker.join();
+    }
+}
+
+size_t ThreadPool::GetThreadCount() const {
+    return workers_.size() + 1;
+}
+
+void ThreadPool::ParallelFor(size_t count, const std::function<void(size_t)>& body) {
+    if(workers_.empty() || count <= GRAIN_SIZE) {
+        for(size_t i = 0; i < count; ++i) {
+            body(i);
+        }
+        return;
+    }
+
+    {
+        std::lock_guard lock(mutex_);
+        body_ = &body;
+        count_ = count;
+        next_index_ = 0;
+        error_ = nullptr;
+        active_workers_ = workers_.size();
+        ++generation_;
+    }
+    start_cv_.notify_all();
+
+    RunChunks();
+
+    std::unique_lock lock(mutex_);
+    done_cv_.wait(lock, [this] {
+        return active_workers_ == 0;
+    });
+    body_ = nullptr;
+    if(error_) {
+        std::rethrow_exception(std::exchange(error_, nullptr));
+    }
+}
+
+void ThreadPool::WorkerLoop() {
+    size_t seen_generation = 0;
+    while(true) {
+        {
+            std::unique_lock lock(mutex_);
+            start_cv_.wait(lock, [&] {
+                return stop_ || generation_ != seen_generation;
+            });
+            if(stop_) {
+                return;
+            }
+            seen_generation = generation_;
+        }
+
+        RunChunks();
+
+        std::lock_guard lock(mutex_);
+        if(--active_workers_ == 0) {
+            done_cv_.notify_one();
+        }
+    }
+}
+
+void ThreadPool::RunChunks() {
+    while(true) {
+        const size_t begin = next_index_.fetch_add(GRAIN_SIZE);
+        if(begin >= count_) {
+            return;
+        }
+
+        const size_t end = std::min(begin + GRAIN_SIZE, count_);
+        try {
+            for(size_t i = begin; i < end; ++i) {
+                (*body_)(i);
+            }
+        } catch(...) {
+            std::lock_guard lock(mutex_);
+            if(!error_) {
+                error_ = std::current_exception();
+            }
+        }
+    }
+}
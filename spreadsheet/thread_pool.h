@@ -0,0 +1,48 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Пул потоков для параллельной обработки диапазона индексов. Вызывающий
+// поток участвует в работе наравне с фоновыми.
+class ThreadPool {
+public:
+    // thread_count - общее число потоков, включая вызывающий
+    explicit ThreadPool(size_t thread_count);
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    size_t GetThreadCount() const;
+
+    // Вызывает body(i) для всех i из [0, count), распределяя индексы между
+    // потоками порциями. Возвращает управление, когда все вызовы завершены.
+    // Первое из исключений, выброшенных body, передаётся вызывающему.
+    void ParallelFor(size_t count, const std::function<void(size_t)>& body);
+
+private:
+    static constexpr size_t GRAIN_SIZE = 64;
+
+    void WorkerLoop();
+    void RunChunks();
+
+    std::vector<std::thread> workers_;
+    std::mutex mutex_;
+    std::condition_variable start_cv_;
+    std::condition_variable done_cv_;
+
+    const std::function<void(size_t)>* body_ = nullptr;
+    size_t count_ = 0;
+    std::atomic<size_t> next_index_{0};
+    std::exception_ptr error_;
+    size_t generation_ = 0;
+    size_t active_workers_ = 0;
+    bool stop_ = false;
+};